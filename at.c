@@ -0,0 +1,257 @@
+/* See LICENSE file for copyright and license details. */
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "at.h"
+#include "util.h"
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+/* returns the offset of the first CR or LF in s, or n if there is none */
+size_t
+memcrlf(const char *s, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+		                                          _mm_cmpeq_epi8(v, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#else
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, s + i, 8);
+		if (HASZERO(w ^ ('\r' * ONES)) | HASZERO(w ^ ('\n' * ONES)))
+			break;
+	}
+#endif
+
+	for (; i < n; i++) {
+		if (s[i] == '\r' || s[i] == '\n')
+			return i;
+	}
+
+	return n;
+}
+
+/* Feeds the bytes of buf that haven't been looked at yet through the
+ * parser. Returns AT_TOK_LINE with *line set to a complete, non-blank line,
+ * AT_TOK_PROMPT for a prompt, or AT_TOK_NONE once buf is used up. */
+int
+at_next(struct at_parser *p, const char *buf, size_t len, struct line *line)
+{
+	size_t end;
+
+	while (p->scanned < len) {
+		switch (p->state) {
+		case AT_START:
+			if (buf[p->scanned] == '\r' || buf[p->scanned] == '\n') {
+				p->start = ++p->scanned;
+				break;
+			}
+
+			p->state = buf[p->scanned] == '>' && p->prompt ? AT_PROMPT : AT_LINE;
+			p->start = p->scanned++;
+			break;
+		case AT_PROMPT:
+			if (buf[p->scanned] != ' ') {
+				p->state = AT_LINE;
+				break;
+			}
+
+			p->state = AT_START;
+			p->start = ++p->scanned;
+			return AT_TOK_PROMPT;
+		case AT_LINE:
+			end = p->scanned + memcrlf(buf + p->scanned, len - p->scanned);
+			p->scanned = end;
+			if (end == len)
+				break;
+
+			line->off = p->start;
+			line->len = end - p->start;
+			p->state = AT_START;
+			p->start = end;
+			return AT_TOK_LINE;
+		}
+	}
+
+	return AT_TOK_NONE;
+}
+
+/* returns how many bytes at the start of the buffer the parser is done
+ * with, and rebases its offsets as if they had been removed */
+size_t
+at_release(struct at_parser *p)
+{
+	size_t n = p->start;
+
+	p->scanned -= n;
+	p->start = 0;
+	return n;
+}
+
+void
+at_reset(struct at_parser *p)
+{
+	p->state = AT_START;
+	p->scanned = 0;
+	p->start = 0;
+}
+
+static struct at_handler handlers[AT_TABLE_SIZE];
+
+static unsigned int
+at_hash(const char *key, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static const struct at_handler *
+at_find(const char *key, size_t len)
+{
+	unsigned int i = at_hash(key, len);
+	const struct at_handler *h;
+
+	for (int probes = 0; probes < AT_TABLE_SIZE; probes++, i++) {
+		h = &handlers[i & (AT_TABLE_SIZE - 1)];
+		if (!h->key)
+			return NULL;
+		if (h->keylen == len && memcmp(h->key, key, len) == 0)
+			return h;
+	}
+
+	return NULL;
+}
+
+/* returns -1 if the table is full or key is already taken */
+int
+at_register(const char *key, int (*fn)(char *line, size_t len))
+{
+	size_t len = strlen(key);
+	unsigned int i = at_hash(key, len);
+	struct at_handler *h;
+
+	if (len > AT_KEY_MAX || at_find(key, len))
+		return -1;
+
+	for (int probes = 0; probes < AT_TABLE_SIZE; probes++, i++) {
+		h = &handlers[i & (AT_TABLE_SIZE - 1)];
+		if (h->key)
+			continue;
+
+		h->key = key;
+		h->keylen = len;
+		h->fn = fn;
+		return 0;
+	}
+
+	return -1;
+}
+
+const struct at_handler *
+at_lookup(const char *line, size_t len)
+{
+	const struct at_handler *h;
+	const char *end;
+	size_t keylen = len;
+
+	if ((end = memchr(line, ':', MIN(len, AT_KEY_MAX + 1))))
+		keylen = end - line;
+
+	if (keylen <= AT_KEY_MAX && (h = at_find(line, keylen)))
+		return h;
+
+	if ((end = memchr(line, ' ', MIN(keylen, AT_KEY_MAX + 1))))
+		return at_find(line, end - line);
+
+	return NULL;
+}
+
+static const char *
+at_skipspace(const char *p, const char *end)
+{
+	while (p < end && *p == ' ')
+		p++;
+
+	return p;
+}
+
+/* Splits the arguments after the ':' of line into at most max fields.
+ * Returns the number of fields, or -1 if the line has no ':' or an argument
+ * is malformed. Fields past max are checked but not stored. */
+int
+at_fields(const char *line, size_t len, struct at_field *fields, int max)
+{
+	const char *p = memchr(line, ':', len), *end = line + len, *q;
+	struct at_field f;
+	int n = 0;
+
+	if (!p)
+		return -1;
+
+	for (p++;; p++) {
+		p = at_skipspace(p, end);
+		f.s = p;
+		f.len = 0;
+		f.n = 0;
+
+		if (p == end || *p == ',') {
+			f.type = AT_FIELD_EMPTY;
+		} else if (*p == '"') {
+			if (!(q = memchr(p + 1, '"', end - p - 1)))
+				return -1;
+
+			f.type = AT_FIELD_STRING;
+			f.s = p + 1;
+			f.len = q - p - 1;
+			p = q + 1;
+		} else {
+			bool neg = *p == '-';
+
+			p += neg;
+			if (p == end || *p < '0' || *p > '9')
+				return -1;
+
+			f.type = AT_FIELD_INT;
+			for (; p < end && *p >= '0' && *p <= '9'; p++) {
+				if (f.n > (LONG_MAX - (*p - '0')) / 10)
+					return -1;
+				f.n = f.n * 10 + (*p - '0');
+			}
+			if (neg)
+				f.n = -f.n;
+		}
+
+		if (n < max)
+			fields[n] = f;
+		n++;
+
+		p = at_skipspace(p, end);
+		if (p == end)
+			return n < max ? n : max;
+		if (*p != ',')
+			return -1;
+	}
+}
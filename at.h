@@ -0,0 +1,75 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef AT_H
+#define AT_H
+
+#include <stddef.h>
+#include <string.h>
+
+/* a line of modem output, relative to the buffer it was split from, not
+ * including the line terminator */
+struct line {
+	size_t off;
+	size_t len;
+};
+
+enum at_state {
+	AT_START, /* between lines */
+	AT_LINE,
+	AT_PROMPT, /* seen a '>' at the start of a line */
+};
+
+enum at_token {
+	AT_TOK_NONE, /* need more input */
+	AT_TOK_LINE,
+	AT_TOK_PROMPT,
+};
+
+/* Splits modem output into lines and "> " prompts as it arrives. It keeps
+ * its position between calls, so every byte is looked at once no matter
+ * how the input is split up. Offsets are relative to the start of the
+ * buffer, which at_release() moves forward. */
+struct at_parser {
+	enum at_state state;
+	size_t scanned; /* bytes looked at so far */
+	size_t start; /* bytes the parser is done with */
+	int prompt; /* whether a '>' at the start of a line is a prompt */
+};
+
+/* Handlers for result codes and URCs are keyed on the line up to the first
+ * ':', or on the whole line, falling back to the part before the first
+ * space so that "CONNECT 9600" finds "CONNECT". fn returns the status to
+ * report for a final result code, or 0. */
+struct at_handler {
+	const char *key;
+	size_t keylen;
+	int (*fn)(char *line, size_t len);
+};
+
+/* One argument of a result code or URC, e.g. the ones in
+ * +CLIP: "+15551234567",145,,,,0. Strings point into the line and don't
+ * include the quotes, so they aren't NUL-terminated. */
+enum at_field_type {
+	AT_FIELD_EMPTY,
+	AT_FIELD_INT,
+	AT_FIELD_STRING,
+};
+
+struct at_field {
+	enum at_field_type type;
+	const char *s;
+	size_t len;
+	long n;
+};
+
+#define AT_TABLE_SIZE 64 /* a power of two */
+#define AT_KEY_MAX 16
+
+size_t memcrlf(const char *s, size_t n);
+int at_next(struct at_parser *p, const char *buf, size_t len, struct line *line);
+size_t at_release(struct at_parser *p);
+void at_reset(struct at_parser *p);
+int at_register(const char *key, int (*fn)(char *line, size_t len));
+const struct at_handler *at_lookup(const char *line, size_t len);
+int at_fields(const char *line, size_t len, struct at_field *fields, int max);
+
+#endif /* AT_H */
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -7,6 +8,55 @@
 #include "atd.h"
 #include "encdec.h"
 
+static const char *atcmd_names[] = {
+    [ATNONE] = "none",
+    [ATD] = "ATD",
+    [ATA] = "ATA",
+    [ATH] = "ATH",
+    [CLCC] = "AT+CLCC",
+    [ATCMGS] = "AT+CMGS",
+    [ATCMMS] = "AT+CMMS",
+};
+
+/* upper bound of the bucket the p-th percentile falls in, in us */
+static unsigned long
+percentile(const uint32_t *hist, int p)
+{
+    unsigned long total = 0, seen = 0;
+
+    for (int i = 0; i < STATS_BUCKETS; i++)
+        total += hist[i];
+
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen && seen * 100 >= total * p)
+            return i ? 1UL << i : 0;
+    }
+
+    return 0;
+}
+
+static void
+print_stats(const struct stats *st)
+{
+    printf("queued %u call, %u query, %u bulk, %u clients\n",
+           st->queued[PRIO_CALL], st->queued[PRIO_QUERY], st->queued[PRIO_BULK], st->clients);
+    printf("buffered %u to modem, %u from modem, %u to clients\n",
+           st->backend_in, st->backend_out, st->client_in);
+    printf("%-8s %8s %8s %8s %10s %10s %10s %10s\n", "command", "sent", "ok", "error",
+           "wait p50", "wait p99", "svc p50", "svc p99");
+    for (int c = ATNONE + 1; c < ATLAST; c++) {
+        const struct cmdstats *cs = &st->cmds[c];
+
+        if (!cs->sent)
+            continue;
+        printf("%-8s %8u %8u %8u %8luus %8luus %8luus %8luus\n", atcmd_names[c],
+               cs->sent, cs->ok, cs->error,
+               percentile(cs->wait, 50), percentile(cs->wait, 99),
+               percentile(cs->service, 50), percentile(cs->service, 99));
+    }
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -30,6 +80,8 @@ main(int argc, char *argv[])
         cmd = CMD_CALL_EVENTS;
     } else if (strcmp(argv[1], "submit") == 0) {
         cmd = CMD_SUBMIT;
+    } else if (strcmp(argv[1], "stats") == 0) {
+        cmd = CMD_STATS;
     }
 
     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -62,6 +114,9 @@ main(int argc, char *argv[])
         break;
     case CMD_SUBMIT:
         atd_cmd_submit(sock, argv[2], argv[3]);
+        break;
+    case CMD_STATS:
+        atd_cmd_stats(sock);
     }
 
     char op;
@@ -73,6 +128,13 @@ main(int argc, char *argv[])
     else if (op == STATUS_OK)
         fprintf(stderr, "ERROR\n");
     else if (op == STATUS_CALL) {
+    } else if (op == STATUS_STATS) {
+        struct stats st;
+
+        if (dec_stats(sock, &st) == -1)
+            fprintf(stderr, "malformed stats\n");
+        else
+            print_stats(&st);
     }
 
     sleep(1);
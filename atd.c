@@ -1,28 +1,39 @@
+#define _GNU_SOURCE
 #include <assert.h>
-#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "at.h"
 #include "atd.h"
+#include "concat.h"
 #include "encdec.h"
+#include "hex.h"
+#include "log.h"
 #include "pdu.h"
+#include "ring.h"
+#include "trace.h"
 #include "util.h"
 #include "queue.h"
 
 #define AT_MAX 256
 #define ATD_SOCKET "/tmp/atd-socket"
 
-#define POLLADD(fd, arg) fd.events |= (arg)
-#define POLLDROP(fd, arg) fd.events &= ~(arg)
+#define EVADD(idx, arg) evmod((idx), fds[idx].events | (arg))
+#define EVDROP(idx, arg) evmod((idx), fds[idx].events & ~(arg))
 
 #define LENGTH(x) (sizeof(x) / sizeof(x[0]))
 
@@ -35,22 +46,31 @@
 #define BACKEND 4
 #define SIGNALINT 5
 #define RSRVD_FDS 6
-#define MAX_FDS 16
-
-#define BUFSIZE 256
-
-int nextline();
-
-int linelen;
-
-char *startup[] = { "AT+CLIP=1\r", "AT+COLP=1\r", "AT+CNMI=2,2,0,1,0\r", NULL };
+#define INITIAL_FDS 16
+#define MAX_EVENTS 16
+
+#define BUFSIZE 4096
+#define OUTQ_MSGS 64
+/* a client's queue holds at least one of the largest event, a message put
+ * together from as many segments as the reassembly cache holds */
+#define SMS_EVENT_MAX (5 + PHONE_NUMBER_MAX_LEN + CONCAT_SEGMENTS * (MSG_DATA_MAX - 1))
+#define CLIENT_QUEUE (SMS_EVENT_MAX > BUFSIZE ? SMS_EVENT_MAX : BUFSIZE)
+
+int send_status(int idx, enum status status);
+int send_stats(int idx);
+bool send_command(int idx, enum atcmd atcmd, union atdata atdata);
+
+/* sent as a single AT line, or one by one if the modem rejects that */
+char *startup[] = { "+CLIP=1", "+COLP=1", "+CNMI=2,2,0,1,0", NULL };
 char **curstartup = startup;
+bool startup_combined = true;
+struct timespec startup_begin;
 
 struct command_args cmddata[] = {
-    [CMD_DIAL] = { ATD, { TYPE_STRING, TYPE_NONE } },
-    [CMD_ANSWER] = { ATA, { TYPE_NONE } },
-    [CMD_HANGUP] = { ATH, { TYPE_NONE } },
-    [CMD_SUBMIT] = { ATCMGS, { TYPE_NONE } },
+    [CMD_DIAL] = { ATD, { TYPE_STRING, TYPE_NONE }, PRIO_CALL },
+    [CMD_ANSWER] = { ATA, { TYPE_NONE }, PRIO_CALL, true },
+    [CMD_HANGUP] = { ATH, { TYPE_NONE }, PRIO_CALL, true },
+    [CMD_SUBMIT] = { ATCMGS, { TYPE_NONE }, PRIO_BULK },
 };
 
 char *atcmds[] = {
@@ -59,109 +79,305 @@ char *atcmds[] = {
     [ATH] = "ATH\r",
     [CLCC] = "AT+CLCC\r",
     [ATCMGS] = "AT+CMGS=%d\r", // requires extra PDU data to be sent
+    [ATCMMS] = "AT+CMMS=1\r",
 };
 
 char *argv0;
 
+/* the segments of a message, each sent with its own AT+CMGS */
+struct submit {
+    int nsegs;
+    int seg; /* the one being sent, -1 while AT+CMMS is */
+    bool prompt; /* waiting for "> " to send its PDU */
+    bool failed;
+    struct {
+        int len; /* TPDU octets, for AT+CMGS */
+        char pdu[2 * PDU_OCTETS_MAX + 1];
+    } segs[];
+};
+
+uint8_t submit_ref; /* reference of the last concatenated message */
+
+enum event {
+    EVENT_CALL,
+    EVENT_SMS,
+    EVENT_LAST,
+};
+
+/* what to do when a client's output queue is full */
+enum overflow {
+    OVERFLOW_DROP, /* drop the oldest queued messages */
+    OVERFLOW_DISCONNECT,
+};
+
 struct fdbuf {
-    ssize_t inlen;
-    ssize_t outlen;
-    char in[BUFSIZE]; /* stuff that needs to go *into* the fd */
-    char out[BUFSIZE]; /* stuff that came out *from* the fd */
-    char *inptr; /* where to write new data to */
-    char *outptr;
+    struct ring in; /* stuff that needs to go *into* the fd */
+    struct ring out; /* stuff that came out *from* the fd */
+    /* message boundaries in a client's in ring, so that whole messages
+     * can be dropped when it overflows */
+    size_t qhead; /* where the first queued message starts */
+    size_t ends[OUTQ_MSGS]; /* where each queued message ends */
+    int first;
+    int nmsgs;
+};
+
+/* an fd registered with the epoll instance, the slot index is the epoll
+ * user data so readiness can be dispatched without searching */
+struct evfd {
+    int fd;
+    uint32_t events;
+    int nextfree; /* next slot on the free list, only valid while fd is -1 */
+    int subpos[EVENT_LAST]; /* position in subscribers[], or -1 */
+};
+
+/* clients subscribed to each class of event */
+struct subscribers {
+    int *idx;
+    size_t len;
+    size_t cap;
 };
 
 struct command cmd;
 int cmd_progress;
 bool active_command = false;
 enum atcmd currentatcmd;
-int calld = -1, smsd = -1;
-
-struct fdbuf fdbufs[MAX_FDS];
-struct pollfd fds[MAX_FDS];
+char dialnum[PHONE_NUMBER_MAX_LEN + 1]; /* number of the last ATD */
+struct subscribers subscribers[EVENT_LAST];
+enum overflow overflow = OVERFLOW_DROP;
+bool cmt_pending = false; /* the next line is the PDU of a +CMT */
+int cmt_len; /* TPDU length the +CMT announced */
+struct at_parser parser;
+struct stats stats;
+uint64_t cmd_sent; /* when the current AT command went out, 0 once it's done */
+uint64_t cmd_ready; /* when the next AT command could have gone out */
+
+/* the client table grows on demand, free client slots are kept on a list
+ * threaded through fds so that allocating and releasing one is O(1) */
+struct fdbuf *fdbufs;
+struct evfd *fds;
+size_t nfds;
+int freefds = -1;
+int epfd = -1;
 
 struct call calls[MAX_CALLS];
 
+uint64_t
+monotonic_us()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+void
+stats_record(uint32_t *hist, uint64_t us)
+{
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+
+    hist[MIN(b, STATS_BUCKETS - 1)]++;
+}
+
+/* count the final result of the AT command in flight */
+void
+command_done(bool ok)
+{
+    struct cmdstats *cs = &stats.cmds[currentatcmd];
+
+    if (!cmd_sent)
+        return;
+
+    stats_record(cs->service, monotonic_us() - cmd_sent);
+    if (ok)
+        cs->ok++;
+    else
+        cs->error++;
+    cmd_sent = 0;
+}
+
+int
+subscribe(enum event ev, int i)
+{
+    struct subscribers *s = &subscribers[ev];
+    int *idx;
+
+    if (fds[i].subpos[ev] != -1)
+        return 0;
+
+    if (s->len == s->cap) {
+        idx = realloc(s->idx, (s->cap ? 2 * s->cap : 4) * sizeof(*idx));
+        if (!idx)
+            return -1;
+        s->idx = idx;
+        s->cap = s->cap ? 2 * s->cap : 4;
+    }
+
+    fds[i].subpos[ev] = s->len;
+    s->idx[s->len++] = i;
+    return 0;
+}
+
+/* drop a client from every subscriber list by moving the last subscriber
+ * into its place */
+void
+unsubscribe(int i)
+{
+    struct subscribers *s;
+    int pos, last;
+
+    for (int ev = 0; ev < EVENT_LAST; ev++) {
+        if ((pos = fds[i].subpos[ev]) == -1)
+            continue;
+
+        s = &subscribers[ev];
+        last = s->idx[--s->len];
+        s->idx[pos] = last;
+        fds[last].subpos[ev] = pos;
+        fds[i].subpos[ev] = -1;
+    }
+}
+
+/* Splits msg into the segments it is sent as and encodes each. Returns
+ * NULL if it takes more than PDU_SEGMENTS_MAX or allocation fails. */
+struct submit *
+submit_new(const char *num, const char *msg)
+{
+    struct pdu_segment segs[PDU_SEGMENTS_MAX];
+    unsigned char raw[PDU_OCTETS_MAX];
+    struct submit *s;
+    int nsegs, len;
+
+    if ((nsegs = pdu_split(msg, segs, LEN(segs))) < 0) {
+        log_warn(LOG_SMS, "message to %s needs more than %d segments", num, PDU_SEGMENTS_MAX);
+        return NULL;
+    }
+
+    if (!(s = malloc(sizeof(*s) + nsegs * sizeof(s->segs[0]))))
+        return NULL;
+
+    s->nsegs = nsegs;
+    s->seg = nsegs > 1 ? -1 : 0;
+    s->prompt = false;
+    s->failed = false;
+    if (nsegs > 1)
+        submit_ref++;
+
+    for (int i = 0; i < nsegs; i++) {
+        len = encode_pdu(NULL, num, &segs[i], submit_ref, i + 1, nsegs);
+        if (len > sizeof(raw)) {
+            log_warn(LOG_SMS, "number %s is too long", num);
+            free(s);
+            return NULL;
+        }
+
+        encode_pdu((char *)raw, num, &segs[i], submit_ref, i + 1, nsegs);
+        hex_encode(s->segs[i].pdu, raw, len);
+        s->segs[i].pdu[2 * len] = 0;
+        s->segs[i].len = len;
+        log_debug(LOG_SMS, "submit pdu %d/%d: %s", i + 1, nsegs, s->segs[i].pdu);
+    }
+
+    return s;
+}
+
+/* Whether op can be taken now. Only what goes to the modem needs room in
+ * the queue, and a duplicate merged into a queued one needs none. */
+static bool
+cmd_fits(enum ops op)
+{
+    switch (op) {
+    case CMD_DIAL:
+    case CMD_ANSWER:
+    case CMD_HANGUP:
+    case CMD_SUBMIT:
+        return cmdq.count < QUEUE_SIZE || command_mergeable(op, &cmddata[op]);
+    default:
+        return true;
+    }
+}
+
 /* add one command to queue, returns the number of bytes intepreted if the
- * command was validated and added successfully, -1 if the queue is full or we
- * run out of memory, and -2 if the command is invalid but terminated */
+ * command was validated and added successfully, 0 if the command hasn't been
+ * fully received yet, -1 if the queue is full or we run out of memory, -2
+ * if the command is invalid but terminated, and -3 if answering it right
+ * away dropped the client */
 ssize_t cmdadd(int index) {
-    struct command cmd = {index, CMD_NONE};
-    char *ptr = fdbufs[index].out;
-    size_t count = 0;
-    char *num, *msg, *raw;
+    struct command cmd = { .index = index, .op = CMD_NONE };
+    char *ptr = ring_data(&fdbufs[index].out);
+    size_t avail = ring_len(&fdbufs[index].out) - 1;
+    ssize_t count = 0, numlen;
+    char *num, *msg;
 
-    if (cmdq.count == QUEUE_SIZE)
+    cmd.op = *(ptr++);
+    if (!cmd_fits(cmd.op))
         return -1;
 
-    cmd.op = *(ptr++);
     switch (cmd.op) {
     case CMD_DIAL:
-        count = dec_str(ptr, &cmd.data.dial.num);
-        if (count == -1)
-            return -1;
+        count = dec_str(ptr, avail, &cmd.data.dial.num);
+        if (count <= 0)
+            return count;
 
-        fprintf(stderr, "received dial with number %s\n", cmd.data.dial.num);
+        log_info(LOG_CMD, "received dial with number %s", cmd.data.dial.num);
         break;
     case CMD_ANSWER:
-        fprintf(stderr, "received answer\n");
+        log_info(LOG_CMD, "received answer");
         break;
     case CMD_HANGUP:
-        fprintf(stderr, "received hangup\n");
+        log_info(LOG_CMD, "received hangup");
         break;
     case CMD_CALL_EVENTS:
-        fprintf(stderr, "received request call events\n");
-        if (calld == -1)
-            calld = index;
+        log_debug(LOG_CMD, "received request call events");
+        if (subscribe(EVENT_CALL, index) == -1)
+            return -1;
         goto end;
         break;
     case CMD_SMS_EVENTS:
-        fprintf(stderr, "received request sms events\n");
-        if (smsd == -1)
-            smsd = index;
+        log_debug(LOG_CMD, "received request sms events");
+        if (subscribe(EVENT_SMS, index) == -1)
+            return -1;
         goto end;
         break;
+    case CMD_STATS:
+        log_debug(LOG_CMD, "received stats request");
+        send_stats(index);
+        if (fds[index].fd == -1)
+            return -3;
+        goto end;
     case CMD_SUBMIT:
-        count = dec_str(ptr, &num);
-        if (count == -1)
-            return -1;
-
-        ptr += count;
-        count = dec_str(ptr, &msg);
-        if (count == -1)
-            return -1;
-
-        count = encode_pdu(NULL, num, msg);
-        raw = malloc(count);
-        if (!raw)
-            return -1;
+        numlen = dec_str(ptr, avail, &num);
+        if (numlen <= 0)
+            return numlen;
+
+        ptr += numlen;
+        count = dec_str(ptr, avail - numlen, &msg);
+        if (count <= 0) {
+            free(num);
+            return count;
+        }
+        count += numlen;
 
-        encode_pdu(raw, num, msg);
+        log_info(LOG_CMD, "received submit to number %s", num);
+        cmd.data.submit = submit_new(num, msg);
         free(num);
         free(msg);
-
-        cmd.data.submit.len = count;
-        cmd.data.submit.pdu = malloc(2*count + 1);
-        if (!cmd.data.submit.pdu)
-            return -1;
-
-        for (int i = 0; i < count; i++) {
-            htoa(&cmd.data.submit.pdu[2*i], raw[i]);
+        if (!cmd.data.submit) {
+            cmd.op = CMD_NONE;
+            send_status(index, STATUS_ERROR);
+            if (fds[index].fd == -1)
+                return -3;
+            goto end;
         }
-        cmd.data.submit.pdu[2*count] = 0;
-        free(raw);
-
-        fprintf(stderr, "received submit to number %s: %s\n", num, cmd.data.submit.pdu);
         break;
     default:
-        fprintf(stderr, "got code: %d\n", cmd.op);
+        log_warn(LOG_CMD, "got code: %d", cmd.op);
         return -2;
     }
 
     /* we already checked that the queue has enough capacity */
+    cmd.queued = monotonic_us();
     if (cmd.op)
-        command_enqueue(cmd);
+        command_enqueue(cmd, &cmddata[cmd.op]);
 
 end:
     return count + 1;
@@ -181,48 +397,306 @@ lprint(char *buf, size_t len)
     }
 }
 
-ssize_t
-fdbuf_write(int idx)
+static int
+fdgrow()
 {
-    int wr = write(fds[idx].fd, &fdbufs[idx].in, fdbufs[idx].inlen);
-    if (wr == -1)
+    size_t n = nfds ? 2 * nfds : INITIAL_FDS;
+    struct evfd *nfd;
+    struct fdbuf *nbuf;
+
+    nfd = realloc(fds, n * sizeof(*fds));
+    if (!nfd)
         return -1;
+    fds = nfd;
 
-    fdbufs[idx].inlen -= wr;
-    fdbufs[idx].inptr -= wr;
-    memmove(fdbufs[idx].in, fdbufs[idx].in + wr, BUFSIZE - wr);
+    nbuf = realloc(fdbufs, n * sizeof(*fdbufs));
+    if (!nbuf)
+        return -1;
+    fdbufs = nbuf;
+
+    memset(fdbufs + nfds, 0, (n - nfds) * sizeof(*fdbufs));
+    for (size_t i = n; i-- > nfds;) {
+        fds[i].fd = -1;
+        fds[i].events = 0;
+        for (int ev = 0; ev < EVENT_LAST; ev++)
+            fds[i].subpos[ev] = -1;
+        if (i >= RSRVD_FDS) {
+            fds[i].nextfree = freefds;
+            freefds = i;
+        }
+    }
 
-    return wr;
+    nfds = n;
+    return 0;
+}
+
+/* returns a free client slot, or -1 if the table can't be grown */
+int
+fdalloc()
+{
+    int i;
+
+    if (freefds == -1 && fdgrow() == -1)
+        return -1;
+
+    i = freefds;
+    if (!fdbufs[i].in.buf && (ring_init(&fdbufs[i].in, CLIENT_QUEUE) == -1 ||
+                              ring_init(&fdbufs[i].out, BUFSIZE) == -1)) {
+        ring_free(&fdbufs[i].in);
+        return -1;
+    }
+
+    freefds = fds[i].nextfree;
+    ring_reset(&fdbufs[i].in);
+    ring_reset(&fdbufs[i].out);
+    fdbufs[i].qhead = 0;
+    fdbufs[i].first = 0;
+    fdbufs[i].nmsgs = 0;
+    return i;
+}
+
+void
+fdfree(int i)
+{
+    fds[i].nextfree = freefds;
+    freefds = i;
+}
+
+int
+evadd(int idx, int fd, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.u32 = idx };
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        return -1;
+
+    fds[idx].fd = fd;
+    fds[idx].events = events;
+    return 0;
+}
+
+int
+evmod(int idx, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.u32 = idx };
+
+    if (fds[idx].events == events)
+        return 0;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fds[idx].fd, &ev) == -1)
+        return -1;
+
+    fds[idx].events = events;
+    return 0;
+}
+
+void
+evclose(int idx)
+{
+    /* already closed, freeing the slot again would corrupt the free list */
+    if (fds[idx].fd == -1)
+        return;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fds[idx].fd, NULL);
+    close(fds[idx].fd);
+    fds[idx].fd = -1;
+    fds[idx].events = 0;
+
+    if (idx >= RSRVD_FDS)
+        fdfree(idx);
+}
+
+ssize_t
+fdbuf_write(int idx)
+{
+    char *data = ring_data(&fdbufs[idx].in);
+    ssize_t ret = ring_write(&fdbufs[idx].in, fds[idx].fd);
+
+    if (idx == BACKEND && ret > 0)
+        trace_record(TRACE_WRITE, data, ret, monotonic_us());
+    return ret;
 }
 
 ssize_t
 fdbuf_read(int idx)
 {
-    int r = read(fds[idx].fd, fdbufs[idx].outptr, BUFSIZE - fdbufs[idx].outlen);
-    if (r == -1)
+    char *data = ring_wptr(&fdbufs[idx].out);
+    ssize_t ret = ring_read(&fdbufs[idx].out, fds[idx].fd);
+
+    if (idx == BACKEND && ret > 0)
+        trace_record(TRACE_READ, data, ret, monotonic_us());
+    return ret;
+}
+
+
+void
+dropclient(int i)
+{
+    if (fds[i].fd == -1)
+        return;
+
+    unsubscribe(i);
+    command_forget_client(i);
+    command_forget(&cmd, i);
+    evclose(i);
+}
+
+/* write as much of a client's queue as the socket takes without blocking,
+ * and forget the messages that have been sent completely */
+int
+clientflush(int i)
+{
+    struct fdbuf *b = &fdbufs[i];
+
+    if (fdbuf_write(i) == -1 && errno != EAGAIN)
         return -1;
 
-    fdbufs[idx].outlen += r;
-    fdbufs[idx].outptr += r;
+    while (b->nmsgs && b->ends[b->first] <= b->in.head) {
+        b->qhead = b->ends[b->first];
+        b->first = (b->first + 1) % OUTQ_MSGS;
+        b->nmsgs--;
+    }
+
+    if (ring_len(&b->in))
+        return EVADD(i, EPOLLOUT);
 
-    return r;
+    return EVDROP(i, EPOLLOUT);
 }
 
+/* drop the oldest message that hasn't started going out yet, returns false
+ * if there is none */
+static bool
+dropoldest(int i)
+{
+    struct fdbuf *b = &fdbufs[i];
+    size_t rem, skip;
+    int second;
+
+    if (b->nmsgs == 0)
+        return false;
+
+    if (b->in.head == b->qhead) {
+        ring_consume(&b->in, b->ends[b->first] - b->qhead);
+        b->qhead = b->ends[b->first];
+        b->first = (b->first + 1) % OUTQ_MSGS;
+        b->nmsgs--;
+        return true;
+    }
+
+    /* the first message is partially written and has to be finished, so
+     * drop the second one by sliding the rest of the first over it */
+    if (b->nmsgs == 1)
+        return false;
+
+    second = (b->first + 1) % OUTQ_MSGS;
+    rem = b->ends[b->first] - b->in.head;
+    skip = b->ends[second] - b->ends[b->first];
+    memmove(ring_data(&b->in) + skip, ring_data(&b->in), rem);
+    ring_consume(&b->in, skip);
+    b->qhead += skip;
+    b->first = second;
+    b->nmsgs--;
+    return true;
+}
 
+/* queue a message for a client without blocking, returns -1 if the client
+ * had to be disconnected */
 int
-send_status(int fd, enum status status)
+clientsend(int i, char *buf, size_t len)
 {
-    fprintf(stderr, "send_status\n");
-    char st = status;
-    ssize_t ret;
-    do {
-        ret = write(fd, &st, 1);
-        if (ret == -1)
+    struct fdbuf *b = &fdbufs[i];
+    bool idle = ring_len(&b->in) == 0;
+
+    /* dropping the whole queue wouldn't make room for it either */
+    if (len > b->in.size) {
+        log_warn(LOG_MAIN, "dropped a message of %zu bytes for fd %d, too large to queue", len, i);
+        return 0;
+    }
+
+    while (ring_space(&b->in) < len || b->nmsgs == OUTQ_MSGS) {
+        if (overflow == OVERFLOW_DISCONNECT || !dropoldest(i)) {
+            log_warn(LOG_MAIN, "output queue of fd %d overflowed, disconnecting", i);
+            dropclient(i);
             return -1;
-    } while (ret != 1);
+        }
+        log_warn(LOG_MAIN, "output queue of fd %d overflowed, dropped a message", i);
+    }
+
+    ring_put(&b->in, buf, len);
+    b->ends[(b->first + b->nmsgs++) % OUTQ_MSGS] = b->in.tail;
+
+    /* nothing is waiting for EPOLLOUT, so try to send it right away */
+    if (idle && clientflush(i) == -1) {
+        log_warn(LOG_MAIN, "failed to write to fd %d: %s", i, strerror(errno));
+        dropclient(i);
+        return -1;
+    }
+
     return 0;
 }
 
+/* queue an already serialized event for every subscriber of its class */
+int
+publish(enum event ev, char *buf, size_t len)
+{
+    struct subscribers *s = &subscribers[ev];
+    int ret = 0;
+
+    /* backwards, because a dropped client is replaced by the last one */
+    for (size_t i = s->len; i-- > 0;) {
+        if (clientsend(s->idx[i], buf, len) == -1)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int
+send_status(int idx, enum status status)
+{
+    log_debug(LOG_CMD, "send_status %d", status);
+    char st = status;
+    return clientsend(idx, &st, 1);
+}
+
+int
+send_stats(int idx)
+{
+    char buf[STATS_MSG_MAX];
+
+    for (int p = 0; p < PRIO_LAST; p++)
+        stats.queued[p] = cmdq.q[p].count;
+    stats.backend_in = ring_len(&fdbufs[BACKEND].in);
+    stats.backend_out = ring_len(&fdbufs[BACKEND].out);
+    stats.clients = 0;
+    stats.client_in = 0;
+    for (int i = RSRVD_FDS; i < nfds; i++) {
+        if (fds[i].fd == -1)
+            continue;
+        stats.clients++;
+        stats.client_in += ring_len(&fdbufs[i].in);
+    }
+
+    return clientsend(idx, buf, enc_status_stats(buf, &stats));
+}
+
+/* report the result of a command to its client and everyone waiting on it */
+void
+send_result(struct command *c, enum status status)
+{
+    /* a client dropped while sending is taken out of c, so work on a copy */
+    int waiters[MAX_WAITERS + 1], n = 0;
+
+    waiters[n++] = c->index;
+    memcpy(waiters + n, c->waiters, c->nwaiters * sizeof(*waiters));
+    n += c->nwaiters;
+
+    for (int i = 0; i < n; i++) {
+        if (waiters[i] >= RSRVD_FDS && fds[waiters[i]].fd != -1)
+            send_status(waiters[i], status);
+    }
+}
+
 /* [0] = STATUS_CALL
    [1] = # of update entries
    list of update entries follows
@@ -230,237 +704,391 @@ send_status(int fd, enum status status)
 int
 send_call_status(enum callstatus status, char *num)
 {
-    if (calld != -1) {
-        fprintf(stderr, "update call status\n");
-        return atd_status_call(fds[calld].fd, status, num);
+    char buf[4 + strlen(num)];
+
+    if (subscribers[EVENT_CALL].len == 0)
+        return 0;
+
+    log_debug(LOG_CALL, "update call status");
+    return publish(EVENT_CALL, buf, enc_status_call(buf, status, num));
+}
+
+/* Copies the number from the <number>,<type> fields of a +CLIP or +COLP
+ * into buf, adding the '+' that type 145 (international) implies. Returns
+ * -1 if the number is too long or has characters a number can't have. */
+int
+field_number(char *buf, const struct at_field *num, const struct at_field *type)
+{
+    size_t i, plus = 0;
+
+    if (num->type == AT_FIELD_EMPTY) {
+        buf[0] = '\0';
+        return 0;
+    }
+
+    if (num->type != AT_FIELD_STRING)
+        return -1;
+
+    if (type->type == AT_FIELD_INT && type->n == 145 && num->len > 0 && num->s[0] != '+')
+        plus = 1;
+
+    if (num->len + plus > PHONE_NUMBER_MAX_LEN)
+        return -1;
+
+    for (i = 0; i < num->len; i++) {
+        if (!strchr("+1234567890ABCD*#", num->s[i]) || num->s[i] == '\0')
+            return -1;
     }
 
+    buf[0] = '+';
+    memcpy(buf + plus, num->s, num->len);
+    buf[plus + num->len] = '\0';
     return 0;
 }
 
+/* +CLIP: <number>,<type>[,<subaddr>,<satype>[,<alpha>[,<CLI validity>]]]
+ * the number is left empty unless the validity says it is known */
 int
 send_clip(char *start, size_t len)
 {
     char number[PHONE_NUMBER_MAX_LEN + 1];
-    int ret = sscanf(start, "+CLIP: \"%[+1234567890ABCD]\"", number);
-    if (ret != 1)
+    struct at_field f[6] = { 0 };
+    int n = at_fields(start, len, f, LEN(f));
+
+    if (n < 2 || field_number(number, &f[0], &f[1]) < 0)
         return -1;
 
+    if (n >= 6 && f[5].type == AT_FIELD_INT && f[5].n != 0)
+        number[0] = '\0';
+
     return send_call_status(CALL_INCOMING, number);
 }
 
+/* +COLP: <number>,<type>[,<subaddr>,<satype>[,<alpha>]] */
 int
 send_colp(char *start, size_t len)
 {
     char number[PHONE_NUMBER_MAX_LEN + 1];
-    int ret = sscanf(start, "+COLP: \"%[+1234567890ABCD]\"", number);
-    if (ret != 1)
+    struct at_field f[2];
+
+    if (at_fields(start, len, f, LEN(f)) < 2 || field_number(number, &f[0], &f[1]) < 0)
         return -1;
 
     return send_call_status(CALL_ANSWERED, number);
 }
 
+long
+monotonic_ms()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* passed to the reassembly cache, which calls it for every complete message */
 int
-process_cmt(char *start, size_t len)
+send_sms(const char *num, const char *msg)
 {
-    char pdubuf[1024];
-    struct pdu_msg pdu_msg;
-    unsigned int pdulen;
-    int ret = sscanf(start, "+CMT: ,%u", &pdulen);
-    if (ret != 1)
+    if (subscribers[EVENT_SMS].len == 0)
+        return 0;
+
+    char buf[strlen(num) + strlen(msg) + 5];
+    ssize_t buflen = enc_status_delivered(buf, (char *)num, (char *)msg);
+    if (buflen == -1)
         return -1;
 
-    ret = nextline();
-    if (ret == -1)
+    return publish(EVENT_SMS, buf, buflen);
+}
+
+int
+process_cmt(char *line, size_t len)
+{
+    struct pdu_msg pdu_msg;
+
+    /* the length from +CMT counts the octets after the SMSC address */
+    if (len % 2 || len / 2 <= cmt_len) {
+        log_warn(LOG_SMS, "+CMT PDU is %zu characters, expected more than %d octets", len, cmt_len);
         return -1;
-    fprintf(stderr, "nextline len: %d\n", linelen - 2);
+    }
 
-    memcpy(pdubuf, fdbufs[BACKEND].out, linelen - 2);
-    pdubuf[linelen - 2] = 0;
-    decode_pdu(&pdu_msg, pdubuf);
+    if (decode_pdu(&pdu_msg, line, len) < 0)
+        return -1;
 
-	if (smsd > 0)
-	    return atd_status_delivered(fds[smsd].fd, pdu_msg.d.d.sender.number, pdu_msg.d.d.msg.data);
+    return concat_add(&pdu_msg.d.d, monotonic_ms(), send_sms);
 }
 
-static int
-memcspn(const char *mem, const char *invalid, int n)
+int
+atcmgs2()
 {
-    for (int i = 0; i < n; i++) {
-        if (strchr(invalid, mem[i]))
-            return i;
+    struct ring *in = &fdbufs[BACKEND].in;
+    struct submit *s = cmd.data.submit;
+    int ret;
+
+    ret = snprintf(ring_wptr(in), ring_space(in), "%s\x1a", s->segs[s->seg].pdu);
+    if (ret >= ring_space(in)) {
+       ring_put(in, "\x1a", 1); // \x1a will terminate read for a PDU
+       log_warn(LOG_SMS, "%s: PDU too long!", __func__);
+    } else {
+        ring_commit(in, ret);
     }
 
-    return -1;
+    if (fdbuf_write(BACKEND) == -1)
+        return -1;
+
+    s->prompt = false;
+    return ret;
 }
 
-static int
-memspn(const char *mem, const char *valid, int n)
+/* Called with the result of the last AT command of a submit. Sends the
+ * next segment, or returns the status for the client once they are all
+ * done or one failed. */
+int
+submit_result(bool ok)
 {
-    for (int i = 0; i < n; i++) {
-        if (!strchr(valid, mem[i]))
-            return i;
+    struct submit *s = cmd.data.submit;
+    bool failed;
+
+    if (!ok && currentatcmd == ATCMMS)
+        log_warn(LOG_SMS, "modem rejected AT+CMMS, sending segments anyway");
+    else if (!ok)
+        s->failed = true;
+
+    if (!s->failed && ++s->seg < s->nsegs) {
+        cmd_ready = monotonic_us();
+        if (send_command(BACKEND, ATCMGS, cmd.data))
+            return 0;
+        s->failed = true;
     }
 
-    return n;
+    failed = s->failed;
+    log_info(LOG_SMS, "submit of %d segments %s", s->nsegs, failed ? "failed" : "done");
+    free(s);
+    cmd.op = CMD_NONE;
+    currentatcmd = ATNONE;
+    active_command = false;
+    return failed ? STATUS_ERROR : STATUS_OK;
 }
 
-int
-atcmgs2()
+long
+elapsed_ms(struct timespec *since)
 {
-    char *loc;
-    int ret;
-    size_t before, after;
+    struct timespec now;
 
-    /* this shouldn't be possible */
-    if (!(loc = memchr(fdbufs[BACKEND].out, '>', fdbufs[BACKEND].outlen))) {
-        fprintf(stderr, "%s: prompt not found\n", __func__);
-        // TODO send \x1a
-        return -1;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
 
-    before = loc - fdbufs[BACKEND].out;
-    after = fdbufs[BACKEND].out + fdbufs[BACKEND].outlen - loc;
+/* advance through the startup set once the modem answered the last line */
+void
+startup_result(bool ok)
+{
+    if (startup_combined && !ok) {
+        log_warn(LOG_AT, "modem rejected combined startup line, sending commands one by one");
+        startup_combined = false;
+        return;
+    }
 
-    ret = snprintf(fdbufs[BACKEND].in, BUFSIZE, "%s\x1a", cmd.data.submit.pdu);
+    if (!ok)
+        log_warn(LOG_AT, "startup command AT%s failed", *curstartup);
 
-    fdbufs[BACKEND].inptr = fdbufs[BACKEND].in;
-    if (ret > BUFSIZE) {
-       fdbufs[BACKEND].in[0] = '\x1a'; // \x1a will terminate read for a PDU
-       fdbufs[BACKEND].inlen = 1;
-       fprintf(stderr, "%s: PDU too long!\n", __func__);
+    if (startup_combined) {
+        while (*curstartup)
+            curstartup++;
     } else {
-        fdbufs[BACKEND].inlen = ret;
+        curstartup++;
     }
 
-    ret = fdbuf_write(BACKEND);
+    if (!*curstartup)
+        log_info(LOG_MAIN, "startup finished in %ld ms (%s)", elapsed_ms(&startup_begin),
+                 startup_combined ? "combined" : "one by one");
+}
+
+int
+resp_ok(char *line, size_t len)
+{
+    command_done(true);
+    active_command = false;
+    if (*curstartup)
+        startup_result(true);
 
-    // the prompt will be "> ", so remove the prompt from the buffer
-    memmove(fdbufs[BACKEND].out + before, loc + 2, after);
-    fdbufs[BACKEND].outlen -= 2;
-    fdbufs[BACKEND].outptr -= 2;
+    if (currentatcmd == ATCMGS || currentatcmd == ATCMMS)
+        return submit_result(true);
 
-    free(cmd.data.submit.pdu);
-    cmd.data.submit.pdu = NULL;
+    if (currentatcmd == ATD) {
+        if (send_call_status(CALL_DIALING, dialnum) < 0)
+            log_warn(LOG_CALL, "failed to send call status");
+    }
 
-    return ret;
+    cmd.op = CMD_NONE;
+    currentatcmd = ATNONE;
+    log_debug(LOG_AT, "got OK");
+    return STATUS_OK;
 }
 
 int
-nextline()
+resp_error(char *line, size_t len)
 {
-    fprintf(stderr, "%s start: linelen = %d\n", __func__, linelen);
-    char *start = fdbufs[BACKEND].out;
-    int total = 0;
-
-    do {
-        total += linelen;
-        memmove(start, fdbufs[BACKEND].out + linelen, fdbufs[BACKEND].outlen - linelen);
-        fdbufs[BACKEND].outlen -= linelen;
-        fdbufs[BACKEND].outptr -= linelen;
-        linelen = memcspn(start, "\r\n", fdbufs[BACKEND].outlen);
-        if (linelen == -1) {
-            linelen = 0;
-            return -1; // we didn't find a newline, so there must not be a line to process
-        }
-        linelen += memspn(start+linelen, "\r\n", fdbufs[BACKEND].outlen - linelen);
-    } while (linelen <= 2); // while the line is blank
-
-    return total;
+    command_done(false);
+    active_command = false;
+    if (*curstartup)
+        startup_result(false);
+
+    if (currentatcmd == ATCMGS || currentatcmd == ATCMMS)
+        return submit_result(false);
+    log_debug(LOG_AT, "got ERROR");
+    return STATUS_ERROR;
 }
 
-size_t
-handle_resp(int fd)
+int
+resp_no_carrier(char *line, size_t len)
 {
-    fprintf(stderr, "%s start\n", __func__);
-    char *start = fdbufs[BACKEND].out;
     enum status status = 0;
 
-    // this must be put before nextline, because a prompt doesn't end
-    // in a newline, so nextline won't interpret it as a line
-    if (currentatcmd == ATCMGS && cmd.data.submit.pdu) {
-        if (atcmgs2() < 0)
-            return -1;
+    if (cmd.op == CMD_ANSWER || cmd.op == CMD_DIAL) {
+        command_done(false);
+        active_command = false;
+        status = STATUS_ERROR;
+        cmd.op = CMD_NONE;
+        currentatcmd = ATNONE;
+    }
 
-        return 2;
+    if (send_call_status(CALL_INACTIVE, "") < 0) {
+        log_warn(LOG_CALL, "failed to send call status");
     }
 
-    if (nextline() < 0)
-        return 0;
+    return status;
+}
 
-    if (strncmp(start, "OK", sizeof("OK") - 1) == 0) {
-        status = STATUS_OK;
-        active_command = false;
-        if (*curstartup)
-            curstartup++;
+int
+resp_log(char *line, size_t len)
+{
+    log_info(LOG_AT, "got %.*s", (int)len, line);
+    return 0;
+}
 
-        if (currentatcmd == ATD) {
-            if (send_call_status(CALL_DIALING, cmd.data.dial.num) < 0)
-                fprintf(stderr, "failed to send call status\n");
-        }
+int
+resp_clip(char *line, size_t len)
+{
+    log_debug(LOG_CALL, "got +CLIP");
+    send_clip(line, len);
+    return 0;
+}
 
-        cmd.op = CMD_NONE;
-        currentatcmd = ATNONE;
-        fprintf(stderr, "got OK\n");
-    } else if (strncmp(start, "ERROR", sizeof("ERROR") - 1) == 0) {
-        status = STATUS_ERROR;
-        active_command = false;
-        fprintf(stderr, "got ERROR\n");
-    } else if (strncmp(start, "NO CARRIER", sizeof("NO CARRIER") - 1) == 0) {
-        if (cmd.op == CMD_ANSWER || cmd.op == CMD_DIAL) {
-            active_command = false;
-            status = STATUS_ERROR;
-            cmd.op = CMD_NONE;
-            currentatcmd = ATNONE;
-        }
+int
+resp_colp(char *line, size_t len)
+{
+    log_debug(LOG_CALL, "got +COLP");
+    send_colp(line, len);
+    return 0;
+}
 
-        if (send_call_status(CALL_INACTIVE, "") < 0) {
-            fprintf(stderr, "failed to send call status\n");
-        }
-    } else if (strncmp(start, "RING", sizeof("RING") - 1) == 0) {
-        fprintf(stderr, "got RING\n");
-    } else if (strncmp(start, "CONNECT", sizeof("CONNECT") - 1) == 0) {
-        fprintf(stderr, "got CONNECT\n");
-    } else if (strncmp(start, "BUSY", sizeof("BUSY") - 1) == 0) {
-        fprintf(stderr, "got BUSY\n");
-    } else if (strncmp(start, "+CLIP", sizeof("+CLIP") - 1) == 0) {
-        fprintf(stderr, "got +CLIP\n");
+int
+resp_cmt(char *line, size_t len)
+{
+    struct at_field f[2];
 
-        send_clip(start, linelen);
-    } else if (strncmp(start, "+COLP", sizeof("+COLP") - 1) == 0) {
-        fprintf(stderr, "got +COLP\n");
+    log_debug(LOG_SMS, "got +CMT");
 
-        send_colp(start, linelen);
-    } else if (strncmp(start, "+CMT", sizeof("+CMT") - 1) == 0) {
-        fprintf(stderr, "got +CMT\n");
+    /* +CMT: [<alpha>],<length> */
+    if (at_fields(line, len, f, LEN(f)) != 2 || f[1].type != AT_FIELD_INT || f[1].n <= 0 || f[1].n > 255) {
+        log_warn(LOG_SMS, "malformed +CMT");
+        return 0;
+    }
+
+    cmt_len = f[1].n;
+    cmt_pending = true;
+    return 0;
+}
+
+/* registered with at_register() at startup, new URCs only need an entry */
+struct at_handler resps[] = {
+    { "OK", 0, resp_ok },
+    { "ERROR", 0, resp_error },
+    { "+CME ERROR", 0, resp_error },
+    { "+CMS ERROR", 0, resp_error },
+    { "NO CARRIER", 0, resp_no_carrier },
+    { "RING", 0, resp_log },
+    { "CONNECT", 0, resp_log },
+    { "BUSY", 0, resp_log },
+    { "+CMGS", 0, resp_log },
+    { "+CLIP", 0, resp_clip },
+    { "+COLP", 0, resp_colp },
+    { "+CMT", 0, resp_cmt },
+};
+
+void
+handle_resp(char *start, size_t len)
+{
+    log_debug(LOG_AT, "%s: %.*s", __func__, (int)len, start);
+    const struct at_handler *h;
+    enum status status = 0;
 
-        process_cmt(start, linelen);
+    if (cmt_pending) {
+        cmt_pending = false;
+        if (process_cmt(start, len) < 0)
+            log_warn(LOG_SMS, "failed to process +CMT");
+        return;
     }
 
-    if (status && fd > 0)
-        send_status(fd, status);
+    if ((h = at_lookup(start, len)))
+        status = h->fn(start, len);
 
-    fprintf(stderr, "%s: %.*s\n", __func__, linelen, start);
-    return linelen;
+    if (status)
+        send_result(&cmd, status);
+}
+
+/* handles everything the backend has sent since the last call, the parser
+ * picks up where it left off so partial lines aren't scanned again */
+int
+handle_input()
+{
+    struct ring *out = &fdbufs[BACKEND].out;
+    char *base = ring_data(out);
+    struct line line;
+    int tok;
+
+    do {
+        parser.prompt = currentatcmd == ATCMGS && cmd.data.submit->prompt;
+        tok = at_next(&parser, base, ring_len(out), &line);
+        if (tok == AT_TOK_LINE) {
+            handle_resp(base + line.off, line.len);
+        } else if (tok == AT_TOK_PROMPT && atcmgs2() < 0) {
+            return -1;
+        }
+    } while (tok != AT_TOK_NONE);
+
+    ring_consume(out, at_release(&parser));
+    return 0;
 }
 
 bool
 send_startup()
 {
+    struct ring *in = &fdbufs[BACKEND].in;
+    size_t space = ring_space(in);
+    char *ptr = ring_wptr(in);
     int ret;
-    ret = snprintf(fdbufs[BACKEND].in, BUFSIZE, *curstartup);
-    if (ret >= BUFSIZE) {
-        warn("AT command too long!");
+
+    if (curstartup == startup && startup_combined)
+        clock_gettime(CLOCK_MONOTONIC, &startup_begin);
+
+    ret = snprintf(ptr, space, "AT%s", *curstartup);
+    for (char **c = curstartup + 1; startup_combined && *c && ret < space; c++)
+        ret += snprintf(ptr + ret, space - ret, ";%s", *c);
+    if (ret < space)
+        ret += snprintf(ptr + ret, space - ret, "\r");
+    if (ret >= space) {
+        log_warn(LOG_AT, "AT command too long!");
         return false;
     }
 
-    fprintf(stderr, "send startup: %.*s\n", ret, fdbufs[BACKEND].in);
-    fdbufs[BACKEND].inptr = fdbufs[BACKEND].in;
-    fdbufs[BACKEND].inlen = ret;
+    log_debug(LOG_AT, "send startup: %.*s", ret, ring_wptr(in));
+    ring_commit(in, ret);
 
     ret = fdbuf_write(BACKEND);
     if (ret == -1) {
-        warn("failed to write to backend!");
+        log_warn(LOG_AT, "failed to write to backend: %s", strerror(errno));
         return false;
     }
 
@@ -471,35 +1099,105 @@ send_startup()
 bool
 send_command(int idx, enum atcmd atcmd, union atdata atdata)
 {
+    struct ring *in = &fdbufs[idx].in;
     int ret;
-    fprintf(stderr, "send command: %d\n", atcmd);
+    log_debug(LOG_AT, "send command: %d", atcmd);
     if (atcmd == ATD) {
-        ret = snprintf(fdbufs[idx].in, BUFSIZE, atcmds[atcmd], atdata.dial.num);
+        ret = snprintf(ring_wptr(in), ring_space(in), atcmds[atcmd], atdata.dial.num);
+        snprintf(dialnum, sizeof(dialnum), "%s", atdata.dial.num);
         free(atdata.dial.num);
+    } else if (atcmd == ATCMGS && atdata.submit->seg == -1) {
+        /* keeps the link to the network up between the segments */
+        atcmd = ATCMMS;
+        ret = snprintf(ring_wptr(in), ring_space(in), atcmds[atcmd]);
     } else if (atcmd == ATCMGS) {
-        ret = snprintf(fdbufs[idx].in, BUFSIZE, atcmds[atcmd], atdata.submit.len);
+        ret = snprintf(ring_wptr(in), ring_space(in), atcmds[atcmd],
+                       atdata.submit->segs[atdata.submit->seg].len);
+        atdata.submit->prompt = true;
     } else {
-        ret = snprintf(fdbufs[idx].in, BUFSIZE, atcmds[atcmd]);
+        ret = snprintf(ring_wptr(in), ring_space(in), atcmds[atcmd]);
     }
-    if (ret >= BUFSIZE) {
-        warn("AT command too long!");
+    if (ret >= ring_space(in)) {
+        log_warn(LOG_AT, "AT command too long!");
         return false;
     }
-    fprintf(stderr, "send command: %.*s\n", ret, fdbufs[idx].in);
-    fdbufs[idx].inptr = fdbufs[idx].in;
-    fdbufs[idx].inlen = ret;
+    log_debug(LOG_AT, "send command: %.*s", ret, ring_wptr(in));
+    ring_commit(in, ret);
 
     ret = fdbuf_write(idx);
     if (ret == -1) {
-        warn("failed to write to backend!");
+        log_warn(LOG_AT, "failed to write to backend: %s", strerror(errno));
         return false;
     }
 
     active_command = true;
     currentatcmd = atcmd;
+    cmd_sent = monotonic_us();
+    stats.cmds[atcmd].sent++;
+    stats_record(stats.cmds[atcmd].wait, cmd_sent - cmd_ready);
     return true;
 }
 
+void
+handle_client(int i, uint32_t revents)
+{
+    ssize_t ret;
+
+    /* dropped by something handled earlier in this wakeup */
+    if (fds[i].fd == -1)
+        return;
+
+    if (revents & (EPOLLHUP | EPOLLERR)) {
+        /* TODO check if out buffer is empty */
+        log_warn(LOG_MAIN, "fd %d closed the connection", i);
+        goto drop;
+    }
+
+    if (revents & EPOLLIN) {
+        ret = fdbuf_read(i);
+        if (ret == -1 && errno != EAGAIN) {
+            log_warn(LOG_MAIN, "failed to read from fd %d: %s", i, strerror(errno));
+            goto drop;
+        } else if (ret == 0) {
+            log_warn(LOG_MAIN, "fd %d closed the connection", i);
+            goto drop;
+        }
+
+        // queue every complete command, a partial one stays in the
+        // ring until the rest of it arrives
+        while (ring_len(&fdbufs[i].out)) {
+            ret = cmdadd(i);
+            if (ret == 0) {
+                break;
+            } else if (ret == -1) {
+                log_warn(LOG_CMD, "failed to queue command");
+                break;
+            } else if (ret == -2) {
+                log_warn(LOG_CMD, "invalid command, discarding input");
+                ring_reset(&fdbufs[i].out);
+                break;
+            } else if (ret == -3) {
+                return;
+            }
+
+            assert(ret <= ring_len(&fdbufs[i].out));
+            ring_consume(&fdbufs[i].out, ret);
+        }
+    }
+
+    if (revents & EPOLLOUT) {
+        if (clientflush(i) == -1) {
+            log_warn(LOG_MAIN, "failed to write to fd %d: %s", i, strerror(errno));
+            goto drop;
+        }
+    }
+
+    return;
+
+drop:
+    dropclient(i);
+}
+
 static int
 setup_modem_tty(int fd)
 {
@@ -524,9 +1222,33 @@ setup_modem_tty(int fd)
 int main(int argc, char *argv[])
 {
     argv0 = argv[0];
+    char *trace = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:l:t:")) != -1) {
+        switch (opt) {
+        case 'o':
+            if (strcmp(optarg, "drop") == 0)
+                overflow = OVERFLOW_DROP;
+            else if (strcmp(optarg, "disconnect") == 0)
+                overflow = OVERFLOW_DISCONNECT;
+            else
+                die("usage: %s [-o drop|disconnect] [-l [category=]level] [-t trace] device", argv0);
+            break;
+        case 'l':
+            if (log_parse(optarg) == -1)
+                die("usage: %s [-o drop|disconnect] [-l [category=]level] [-t trace] device", argv0);
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        default:
+            die("usage: %s [-o drop|disconnect] [-l [category=]level] [-t trace] device", argv0);
+        }
+    }
 
-    if (argc != 2)
-        die("exactly 2 arguments required\n");
+    if (argc - optind != 1)
+        die("usage: %s [-o drop|disconnect] [-l [category=]level] [-t trace] device", argv0);
 
     struct sockaddr_un sockaddr = {
         .sun_family = AF_UNIX,
@@ -534,6 +1256,7 @@ int main(int argc, char *argv[])
     };
     ssize_t ret = 0;
     sigset_t mask;
+    struct epoll_event events[MAX_EVENTS];
 
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
@@ -545,9 +1268,25 @@ int main(int argc, char *argv[])
     if (sigintfd == -1)
         die("failed to create signalfd:");
 
+    /* after blocking SIGINT, so the writer thread doesn't take it */
+    if (log_init(STDERR_FILENO) == -1)
+        die("failed to start logging:");
 
-    for (int i = 0; i < MAX_FDS; i++)
-        fds[i].fd = -1;
+
+    if (fdgrow() == -1)
+        die("failed to allocate client table:");
+
+    if (trace && trace_open(trace) == -1)
+        die("failed to open trace %s:", trace);
+
+    for (int i = 0; i < LENGTH(resps); i++) {
+        if (at_register(resps[i].key, resps[i].fn) == -1)
+            die("failed to register handler for %s", resps[i].key);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        die("failed to create epoll instance:");
 
     int backsock;
 
@@ -573,7 +1312,7 @@ int main(int argc, char *argv[])
         goto error;
     }
 #else
-    backsock = open(argv[1], O_RDWR | O_NOCTTY);
+    backsock = open(argv[optind], O_RDWR | O_NOCTTY);
     if (backsock == -1) {
         warn("failed to connect to tty:");
         goto error;
@@ -585,7 +1324,7 @@ int main(int argc, char *argv[])
     }
 #endif
 
-    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sock == -1) {
         warn("failed to create socket:");
         goto error;
@@ -601,144 +1340,137 @@ int main(int argc, char *argv[])
         goto error;
     }
 
-    fds[STDIN].fd = STDIN;
-    fds[STDIN].events = POLLIN;
-    fds[STDOUT].fd = STDOUT;
-    fds[STDOUT].events = 0;
-    fds[LISTENER].fd = sock;
-    fds[LISTENER].events = POLLIN;
-    fds[BACKEND].fd = backsock;
-    fds[BACKEND].events = POLLIN | POLLOUT;
-    fdbufs[BACKEND].outptr = fdbufs[BACKEND].out;
-    fds[SIGNALINT].fd = sigintfd;
-    fds[SIGNALINT].events = POLLIN;
+    if (ring_init(&fdbufs[BACKEND].in, BUFSIZE) == -1 ||
+        ring_init(&fdbufs[BACKEND].out, BUFSIZE) == -1) {
+        warn("failed to allocate backend buffers:");
+        goto error;
+    }
+
+    if (evadd(LISTENER, sock, EPOLLIN) == -1 ||
+        evadd(BACKEND, backsock, EPOLLIN | EPOLLOUT) == -1 ||
+        evadd(SIGNALINT, sigintfd, EPOLLIN) == -1) {
+        warn("failed to register fds with epoll:");
+        goto error;
+    }
 
     while (true) {
-        if (poll(fds, LENGTH(fds), -1) == -1) {
-            warn("poll failed");
-            break;
-        }
+        /* wake up in time to deliver messages whose parts stopped coming */
+        long timeout = concat_expire(monotonic_ms(), send_sms);
+        int nev = epoll_wait(epfd, events, LENGTH(events), timeout);
+        if (nev == -1) {
+            if (errno == EINTR)
+                continue;
 
-        if ((fds[SIGNALINT].revents & POLLIN) ||
-            (fds[LISTENER].revents | fds[BACKEND].revents) & POLLHUP) {
-            warn("time to die");
+            warn("epoll_wait failed:");
             break;
         }
 
-        /* handle clients */
-        for (int i = RSRVD_FDS; i < MAX_FDS; i++) {
-            if (fds[i].fd == -1)
-                continue;
+        uint32_t backrevents = 0;
+        bool accepting = false;
+        for (int e = 0; e < nev; e++) {
+            int i = events[e].data.u32;
+            uint32_t revents = events[e].events;
 
-            if (fds[i].revents & POLLHUP) {
-                /* TODO check if out buffer is empty */
-                warn("closed connection!");
-                close(fds[i].fd);
-                fds[i].fd = -1;
-                if (i == calld)
-                    calld = -1;
-                if (i == smsd)
-                    smsd = -1;
-            } else if (fds[i].revents & POLLIN) {
-                if (fdbuf_read(i) == -1) {
-                    warn("failed to read from fd %d:", i);
-                    break;
-                }
-                // parsecmd should parse as much as it can, letting us know how
-                // much was left unparsed so we can move it to the beginning of
-                // the buffer.
-                ret = cmdadd(i);
-
-                if (ret != -1) {
-                    assert(ret <= BUFSIZE);
-                    fdbufs[i].outlen -= ret;
-                    memmove(fdbufs[i].out, fdbufs[i].out + ret, fdbufs[i].outlen);
-                    assert(fdbufs[i].outlen >= 0);
-                    fdbufs[i].outptr = fdbufs[i].out + fdbufs[i].outlen;
-                } else {
-                    warn("failed to parse command\n");
-                    break;
-                }
-            } else if (fds[i].revents & POLLOUT) {
-                if (fdbuf_write(i) == -1) {
-                    warn("failed to write to fd %d:", i);
-                    break;
+            switch (i) {
+            case SIGNALINT:
+                warn("time to die");
+                goto error;
+            case LISTENER:
+            case BACKEND:
+                if (revents & EPOLLHUP) {
+                    warn("time to die");
+                    goto error;
                 }
 
-                if (fdbufs[i].inlen == 0)
-                    POLLDROP(fds[i], POLLOUT);
+                if (i == LISTENER)
+                    accepting = revents & EPOLLIN;
+                else
+                    backrevents = revents;
+                break;
+            default:
+                handle_client(i, revents);
             }
         }
 
-        if (fds[BACKEND].revents & POLLIN) {
+        if (backrevents & EPOLLIN) {
             ret = fdbuf_read(BACKEND);
-            if (ret == -1) {
+            if (ret == -1 && errno == ENOBUFS) {
+                warn("backend buffer full, discarding");
+                ring_reset(&fdbufs[BACKEND].out);
+                at_reset(&parser);
+            } else if (ret == -1) {
                 warn("failed to read from backend:");
                 break;
             }
-        }
 
-        while ((ret = handle_resp(fds[cmd.index].fd)) != 0) {
-            if (ret < 0) {
-                fprintf(stderr, "atd: failure in atcmgs\n");
+            if (handle_input() < 0) {
+                log_err(LOG_MAIN, "failure in atcmgs");
                 goto error;
             }
         }
 
         /* send next command to modem */
-        if (fds[BACKEND].revents & POLLOUT) {
+        if ((backrevents & EPOLLOUT) && !active_command) {
             if (*curstartup) {
                 if (!send_startup()) {
-                    fprintf(stderr, "failed to send startup command!\n");
+                    log_err(LOG_MAIN, "failed to send startup command!");
                     break;
                 }
-            } else {
-                fprintf(stderr, "have a command!\n");
+            } else if (cmdq.count) {
+                log_debug(LOG_CMD, "have a command!");
 
                 cmd = command_dequeue();
                 assert(cmd.op != CMD_NONE);
+                cmd_ready = cmd.queued;
 
                 if (!send_command(BACKEND, cmddata[cmd.op].atcmd, cmd.data))
                     break;
-
-                /* don't write any more until we hear back */
-                if (fdbufs[BACKEND].inlen == 0) {
-                    POLLDROP(fds[BACKEND], POLLOUT);
-                }
             }
         }
 
-        if (fds[LISTENER].revents & POLLIN) {
-            /* TODO come up with a better way of assigning indices? */
-            for (int i = RSRVD_FDS; i < MAX_FDS; i++) {
-                if (fds[i].fd != -1)
+        /* drain the whole accept queue so a burst of connections is
+         * handled in a single loop iteration */
+        while (accepting) {
+            int fd = accept4(fds[LISTENER].fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
                     continue;
-                
-                fds[i].fd = accept(fds[LISTENER].fd, NULL, NULL);
-                if (fds[i].fd == -1) {
-                    warn("failed to accept connection");
-                    break;
-                }
-                fds[i].events = POLLIN;
-                fdbufs[i].outptr = fdbufs[i].out;
-                fdbufs[i].inptr = fdbufs[i].in;
-                warn("accepted connection!", fds[i].fd);
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    warn("failed to accept connection:");
                 break;
             }
+
+            int i = fdalloc();
+            if (i == -1) {
+                warn("failed to grow client table:");
+                close(fd);
+                continue;
+            }
+
+            if (evadd(i, fd, EPOLLIN) == -1) {
+                warn("failed to register connection:");
+                close(fd);
+                fdfree(i);
+                continue;
+            }
+            log_debug(LOG_MAIN, "accepted connection");
         }
 
-        /* note that this doesn't take effect until the next poll cycle...
-         * maybe this can be replaced with something more integrated? */
+        /* only wait for the backend to become writable when there is
+         * something to send, or level-triggered EPOLLOUT would spin */
         if ((cmdq.count || *curstartup) && !active_command)
-            POLLADD(fds[BACKEND], POLLOUT);
+            EVADD(BACKEND, EPOLLOUT);
         else
-            POLLDROP(fds[BACKEND], POLLOUT);
+            EVDROP(BACKEND, EPOLLOUT);
     }
 
 error:
-    for (int i = STDERR+1; i < MAX_FDS; i++) {
-        if (fds[i].fd > 0)
+    for (int i = STDERR+1; i < nfds; i++) {
+        if (fds[i].fd != -1)
             close(fds[i].fd);
     }
+    if (epfd != -1)
+        close(epfd);
+    trace_close();
     unlink(ATD_SOCKET);
 }
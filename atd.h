@@ -2,10 +2,12 @@
 #define ATD_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define PHONE_NUMBER_MAX_LEN 15
 #define DIALING_DIGITS "0123456789*#+ABC"
 #define MAX_CALLS 8
+#define MAX_WAITERS 8
 
 /* should have at most 256 things */
 enum ops {
@@ -16,6 +18,8 @@ enum ops {
     CMD_CALL_EVENTS,
     CMD_SMS_EVENTS,
     CMD_SUBMIT,
+    CMD_STATS,
+    CMD_LAST,
 };
 
 enum callstatus {
@@ -33,6 +37,7 @@ enum status {
 	STATUS_ERROR,
 	STATUS_CALL,
 	STATUS_DELIVERED,
+	STATUS_STATS,
 };
 
 enum atcmd {
@@ -42,22 +47,25 @@ enum atcmd {
 	ATH,
 	CLCC,
 	ATCMGS,
+	ATCMMS,
+	ATLAST,
 };
 
 union atdata {
 	struct {
 		char *num;
 	} dial;
-	struct {
-		char len;
-		char *pdu;
-	} submit;
+	struct submit *submit;
 };
 
 struct command {
     int index;
     enum ops op;
     union atdata data;
+    /* other clients whose identical command was merged into this one */
+    int waiters[MAX_WAITERS];
+    int nwaiters;
+    uint64_t queued; /* monotonic us when it was enqueued */
 };
 
 struct call {
@@ -76,10 +84,45 @@ enum type {
     TYPE_STRING,
 };
 
+/* scheduling class of a command, lower goes first */
+enum prio {
+	PRIO_CALL,
+	PRIO_QUERY,
+	PRIO_BULK,
+	PRIO_LAST,
+};
+
+/* Latency histograms, bucket 0 counts 0 us and bucket i counts
+ * [2^(i-1), 2^i) us, the last one everything longer. */
+#define STATS_BUCKETS 32
+
+struct cmdstats {
+	uint32_t sent;
+	uint32_t ok;
+	uint32_t error;
+	/* Until sent to the modem, from being enqueued or, for the later
+	 * segments of a submit, from the result of the one before. Recorded
+	 * under the AT command actually sent, so AT+CMMS and every AT+CMGS of
+	 * a multipart submit count on their own. */
+	uint32_t wait[STATS_BUCKETS];
+	uint32_t service[STATS_BUCKETS]; /* sent until the final result */
+};
+
+struct stats {
+	uint16_t queued[PRIO_LAST]; /* commands waiting in each class */
+	uint16_t clients;
+	uint32_t backend_in; /* bytes waiting to be written to the modem */
+	uint32_t backend_out; /* bytes read from it but not yet parsed */
+	uint32_t client_in; /* bytes waiting to be written to all clients */
+	struct cmdstats cmds[ATLAST];
+};
+
 #define MAX_PARAMS 1
 struct command_args {
 	enum atcmd atcmd;
     enum type type[MAX_PARAMS + 1];
+    enum prio prio;
+    bool coalesce; /* idempotent, so a queued duplicate can be merged */
 };
 
 #endif
@@ -1,11 +1,26 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <linux/sockios.h>
 #include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
 
+#include "atd.h"
+#include "encdec.h"
+#include "hex.h"
+#include "pdu.h"
+#include "trace.h"
+
 #define STDOUT 0
 #define STDIN  1
 #define SOCKFD 2
@@ -13,7 +28,1229 @@
 
 #define BUFSIZE 1024
 
-int main() {
+/* how long replay waits for atd to write what it wrote in the trace */
+#define SYNC_TIMEOUT 500000
+
+struct rec {
+    enum trace_dir dir;
+    uint64_t delta;
+    size_t len;
+    size_t off; /* of the bytes in the blob */
+};
+
+static uint64_t
+now_us()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t
+pct(uint64_t *v, size_t n, int p)
+{
+    size_t i = n * p / 100;
+    return n ? v[i < n ? i : n - 1] : 0;
+}
+
+/* "max", which is 0, or a positive number */
+static int
+parse_rate(const char *s, double *v)
+{
+    char *end;
+
+    if (strcmp(s, "max") == 0) {
+        *v = 0;
+        return 0;
+    }
+
+    *v = strtod(s, &end);
+    return end == s || *end || !(*v > 0) ? -1 : 0;
+}
+
+/* reads a whole trace, returns the number of records or -1 */
+static long
+load_trace(const char *path, struct rec **recs, char **blob)
+{
+    static char buf[TRACE_REC_MAX];
+    struct trace_rec r;
+    size_t n = 0, cap = 0, size = 0, blobcap = 0;
+    FILE *f;
+    int ret;
+
+    if (!(f = fopen(path, "r"))) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return -1;
+    }
+
+    if (trace_check(f) == -1) {
+        fprintf(stderr, "%s is not a trace\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    *recs = NULL;
+    *blob = NULL;
+    while ((ret = trace_next(f, &r, buf)) == 1) {
+        if (n == cap) {
+            cap = cap ? 2 * cap : 1024;
+            if (!(*recs = realloc(*recs, cap * sizeof(**recs))))
+                break;
+        }
+        if (size + r.len > blobcap) {
+            blobcap = blobcap ? 2 * blobcap : 1 << 16;
+            while (blobcap < size + r.len)
+                blobcap *= 2;
+            if (!(*blob = realloc(*blob, blobcap)))
+                break;
+        }
+
+        memcpy(*blob + size, r.data, r.len);
+        (*recs)[n++] = (struct rec){ r.dir, r.delta, r.len, size };
+        size += r.len;
+    }
+    fclose(f);
+
+    if (ret != 0) {
+        fprintf(stderr, ret == 1 ? "out of memory\n" : "%s is truncated or corrupt\n", path);
+        return -1;
+    }
+
+    return n;
+}
+
+/* Plays the modem's side of a trace to atd on sock. What the modem sent is
+ * sent with the original gaps divided by speed, or back to back if speed is
+ * 0. What atd wrote is waited for, for at most SYNC_TIMEOUT us, so that
+ * responses never overtake the commands they answer. The time from the
+ * modem's output to atd's next write is atd's response latency. */
+static int
+replay(int sock, const char *path, double speed)
+{
+    struct rec *recs;
+    char *blob, sink[BUFSIZE];
+    long n = load_trace(path, &recs, &blob);
+    uint64_t *lat, *tlat, start, base, sent_at = 0, tsince = 0, trace_us = 0, stalled = 0;
+    size_t nlat = 0, received = 0, expected = 0, bytes = 0, lines = 0, off = 0;
+    size_t unmatched = 0;
+    bool writing = false, replied = true;
+    long i = 0;
+
+    if (n == -1)
+        return -1;
+
+    lat = calloc(n + 1, sizeof(*lat));
+    tlat = calloc(n + 1, sizeof(*tlat));
+    if (!lat || !tlat) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    start = base = now_us();
+
+    while (i < n) {
+        struct rec *r = &recs[i];
+        struct pollfd pfd = { .fd = sock, .events = POLLIN | (writing ? POLLOUT : 0) };
+        uint64_t due, t = now_us();
+        struct timespec ts = { 0 };
+
+        if (r->dir == TRACE_WRITE)
+            due = (base > sent_at ? base : sent_at) + SYNC_TIMEOUT;
+        else
+            due = base + (speed > 0 ? r->delta / speed : 0);
+
+        if (!writing && due > t)
+            ts = (struct timespec){ (due - t) / 1000000, (due - t) % 1000000 * 1000 };
+        if (ppoll(&pfd, 1, writing ? NULL : &ts, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (pfd.revents & POLLIN) {
+            ssize_t ret = read(sock, sink, sizeof(sink));
+            if (ret <= 0) {
+                fprintf(stderr, "atd went away\n");
+                break;
+            }
+            received += ret;
+        } else if (pfd.revents & POLLHUP) {
+            fprintf(stderr, "atd went away\n");
+            break;
+        }
+
+        t = now_us();
+        if (r->dir == TRACE_WRITE) {
+            if (received < expected + r->len && t < due)
+                continue;
+
+            tsince += r->delta;
+            if (received < expected + r->len) {
+                unmatched++;
+                stalled += t - base;
+            } else if (!replied) {
+                lat[nlat] = t - sent_at;
+                tlat[nlat++] = tsince;
+                replied = true;
+            }
+            expected += r->len;
+            trace_us += r->delta;
+            base = t;
+            i++;
+            continue;
+        }
+
+        if (!writing && t < due)
+            continue;
+
+        /* atd may well answer before write() returns */
+        writing = true;
+        sent_at = now_us();
+        while (off < r->len) {
+            ssize_t ret = write(sock, blob + r->off + off, r->len - off);
+            if (ret == -1)
+                break;
+            off += ret;
+        }
+        if (off < r->len) {
+            if (errno == EAGAIN)
+                continue;
+            perror("write");
+            break;
+        }
+
+        for (size_t k = 0; k < r->len; k++)
+            lines += blob[r->off + k] == '\n';
+        bytes += r->len;
+        trace_us += r->delta;
+        writing = false;
+        off = 0;
+        /* keep to the trace's clock rather than drift by the time
+         * each send took */
+        base = speed > 0 ? due : sent_at;
+        tsince = 0;
+        replied = false;
+        i++;
+    }
+
+    /* until atd has read everything, a fast replay has only filled the
+     * socket buffer */
+    int unread;
+    while (i == n && ioctl(sock, SIOCOUTQ, &unread) == 0 && unread > 0)
+        nanosleep(&(struct timespec){ .tv_nsec = 100000 }, NULL);
+
+    /* waiting for writes atd never made isn't atd's time */
+    double secs = (now_us() - start - stalled) / 1e6;
+
+    qsort(lat, nlat, sizeof(*lat), cmp_u64);
+    qsort(tlat, nlat, sizeof(*tlat), cmp_u64);
+    printf("replayed %ld of %ld records in %.3f s, %.3f s in the trace (%.1fx)\n",
+           i, n, secs, trace_us / 1e6, secs > 0 ? trace_us / 1e6 / secs : 0);
+    printf("to atd: %zu bytes, %zu lines, %.0f bytes/s, %.0f lines/s\n",
+           bytes, lines, bytes / secs, lines / secs);
+    printf("from atd: %zu bytes, %zu writes missing after %d ms, not counted above\n",
+           received, unmatched, SYNC_TIMEOUT / 1000);
+    printf("response latency over %zu replies: p50 %llu us, p99 %llu us, max %llu us\n",
+           nlat, (unsigned long long)pct(lat, nlat, 50), (unsigned long long)pct(lat, nlat, 99),
+           (unsigned long long)pct(lat, nlat, 100));
+    printf("in the trace: p50 %llu us, p99 %llu us, max %llu us\n",
+           (unsigned long long)pct(tlat, nlat, 50), (unsigned long long)pct(tlat, nlat, 99),
+           (unsigned long long)pct(tlat, nlat, 100));
+
+    free(lat);
+    free(tlat);
+    free(recs);
+    free(blob);
+    return i == n ? 0 : -1;
+}
+
+/* Generator mode. Every event carries a sequence number that survives the
+ * trip through atd: in the +CLIP number, or at the start of the message
+ * text. NO CARRIER carries nothing, so those are matched in order. */
+enum kind {
+    KIND_RING, /* RING and +CLIP */
+    KIND_NOCARRIER,
+    KIND_CMT, /* a GSM 7-bit message */
+    KIND_UCS2,
+    KIND_CONCAT, /* a message in three segments */
+    KIND_LONG, /* in GEN_LONG_SEGS segments, more than a client queue once held */
+    KIND_LAST,
+};
+
+static const char *kind_names[] = { "ring", "nocarrier", "cmt", "ucs2", "concat", "long" };
+
+#define GEN_SENDER "+15550000"
+#define GEN_CALLER "+1555" /* followed by 7 digits of sequence number */
+#define GEN_LONG_SEGS 16
+#define GEN_BACKLOG (16 << 20) /* give up once this much is unsent */
+#define GEN_GRACE 2000000 /* us to wait for the last deliveries */
+
+struct obuf {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static int
+oput(struct obuf *o, const char *data, size_t len)
+{
+    if (o->len + len > o->cap) {
+        size_t cap = o->cap ? 2 * o->cap : 1 << 16;
+        char *buf;
+
+        while (cap < o->len + len)
+            cap *= 2;
+        if (!(buf = realloc(o->buf, cap)))
+            return -1;
+        o->buf = buf;
+        o->cap = cap;
+    }
+
+    memcpy(o->buf + o->len, data, len);
+    o->len += len;
+    return 0;
+}
+
+/* queues text from GEN_SENDER as one +CMT per segment */
+static int
+put_cmt(struct obuf *o, const char *text, int ref)
+{
+    struct pdu_segment segs[PDU_SEGMENTS_MAX];
+    unsigned char pdu[PDU_OCTETS_MAX + 8];
+    char line[32 + 2 * sizeof(pdu)];
+    int nsegs = pdu_split(text, segs, PDU_SEGMENTS_MAX);
+
+    for (int i = 0; i < nsegs; i++) {
+        int n = encode_deliver((char *)pdu, GEN_SENDER, &segs[i], ref, i + 1, nsegs);
+        /* the length doesn't count the SMSC address */
+        int l = snprintf(line, sizeof(line), "\r\n+CMT: ,%d\r\n", n - 1);
+
+        hex_encode(line + l, pdu, n);
+        l += 2 * n;
+        line[l++] = '\r';
+        line[l++] = '\n';
+        if (oput(o, line, l) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+put_event(struct obuf *o, enum kind kind, long seq)
+{
+    static const char *lorem =
+        "The quick brown fox jumps over the lazy dog while the modem keeps "
+        "delivering segments of a long message that has to be put back "
+        "together in the right order before anyone gets to read it. ";
+    /* each one septet, but two bytes of UTF-8 */
+    static const char *accents = "àèéìòù";
+    char buf[2 * GEN_LONG_SEGS * 153 + 1];
+    int len;
+
+    switch (kind) {
+    case KIND_RING:
+        len = snprintf(buf, sizeof(buf), "\r\nRING\r\n\r\n+CLIP: \"%s%07ld\",145,,,,0\r\n",
+                       GEN_CALLER, seq % 10000000);
+        return oput(o, buf, len);
+    case KIND_NOCARRIER:
+        return oput(o, "\r\nNO CARRIER\r\n", 14);
+    case KIND_CMT:
+        snprintf(buf, sizeof(buf), "#%ld load test message", seq);
+        return put_cmt(o, buf, 0);
+    case KIND_UCS2:
+        snprintf(buf, sizeof(buf), "#%ld нагрузочный тест", seq);
+        return put_cmt(o, buf, 0);
+    case KIND_CONCAT:
+        snprintf(buf, sizeof(buf), "#%ld %s%s", seq, lorem, lorem);
+        return put_cmt(o, buf, seq & 0xff);
+    case KIND_LONG:
+        len = snprintf(buf, sizeof(buf), "#%ld ", seq);
+        for (int n = len; n < GEN_LONG_SEGS * 153; n++, len += 2)
+            memcpy(buf + len, accents + 2 * (n % 6), 2);
+        buf[len] = '\0';
+        return put_cmt(o, buf, seq & 0xff);
+    default:
+        return -1;
+    }
+}
+
+/* "ring=1,cmt=4" */
+static int
+parse_mix(char *spec, int *weights)
+{
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '='), *end;
+        long w;
+        int k;
+
+        if (!eq)
+            return -1;
+        *eq = '\0';
+        for (k = 0; k < KIND_LAST && strcmp(tok, kind_names[k]); k++)
+            ;
+        if (k == KIND_LAST)
+            return -1;
+
+        /* a negative weight would throw off picking a kind */
+        w = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || *end || w < 0 || w > 1000000)
+            return -1;
+        weights[k] = w;
+    }
+
+    return 0;
+}
+
+/* the number in the len bytes at s, which aren't terminated */
+static long
+seqnum(const unsigned char *s, size_t len)
+{
+    long n = 0;
+    size_t i;
+
+    for (i = 0; i < len && s[i] >= '0' && s[i] <= '9'; i++)
+        n = 10 * n + s[i] - '0';
+
+    return i ? n : -1;
+}
+
+/* Takes the complete messages from atd's client stream in buf, returns
+ * how many bytes they took or -1 if the stream makes no sense. */
+static ssize_t
+take_events(char *buf, size_t len, uint64_t now, uint64_t *sent, long count, char *kinds,
+            uint64_t **lat, size_t *nlat, long *fifo, size_t *fifohead, size_t fifotail)
+{
+    size_t off = 0;
+
+    while (off < len) {
+        unsigned char *p = (unsigned char *)buf + off;
+        size_t avail = len - off, need, nlen, mlen;
+        long seq = -1;
+
+        if (p[0] == STATUS_CALL) {
+            if (avail < 4 || avail < (need = 4 + (p[2] | p[3] << 8)))
+                break;
+            nlen = need - 4;
+            if (p[1] == CALL_INACTIVE) {
+                if (*fifohead < fifotail)
+                    seq = fifo[(*fifohead)++];
+            } else if (p[1] == CALL_INCOMING && nlen > strlen(GEN_CALLER)) {
+                seq = seqnum(p + 4 + strlen(GEN_CALLER), nlen - strlen(GEN_CALLER));
+            }
+        } else if (p[0] == STATUS_DELIVERED) {
+            if (avail < 3 || avail < 5 + (nlen = p[1] | p[2] << 8))
+                break;
+            mlen = p[3 + nlen] | p[4 + nlen] << 8;
+            if (avail < (need = 5 + nlen + mlen))
+                break;
+            if (mlen > 1 && p[5 + nlen] == '#')
+                seq = seqnum(p + 6 + nlen, mlen - 1);
+        } else if (p[0] == STATUS_OK || p[0] == STATUS_ERROR) {
+            need = 1;
+        } else {
+            return -1;
+        }
+
+        if (seq >= 0 && seq < count && sent[seq]) {
+            lat[(int)kinds[seq]][nlat[(int)kinds[seq]]++] = now - sent[seq];
+            sent[seq] = 0;
+        }
+        off += need;
+    }
+
+    return off;
+}
+
+static void
+print_latency(const char *name, uint64_t *v, size_t n, size_t total)
+{
+    qsort(v, n, sizeof(*v), cmp_u64);
+    printf("%-10s %7zu of %7zu  p50 %8llu us  p90 %8llu us  p99 %8llu us  max %8llu us\n",
+           name, n, total, (unsigned long long)pct(v, n, 50), (unsigned long long)pct(v, n, 90),
+           (unsigned long long)pct(v, n, 99), (unsigned long long)pct(v, n, 100));
+}
+
+/* Plays a modem that answers every command with OK and sends count events
+ * in the mix given by weights, rate per second in bursts of burst back to
+ * back, or as fast as atd takes them if rate is 0. Subscribes to atd's
+ * events as a client and measures how long each takes to come out. Fails
+ * if any of them never does. */
+static int
+generate(int sock, long count, double rate, int burst, const int *weights)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = "/tmp/atd-socket" };
+    uint64_t *sent = calloc(count, sizeof(*sent)), *lat[KIND_LAST];
+    size_t nlat[KIND_LAST] = { 0 }, total[KIND_LAST] = { 0 }, fifohead = 0, fifotail = 0;
+    char *kinds = malloc(count), in[BUFSIZE], cbuf[1 << 16];
+    long *fifo = malloc(count * sizeof(*fifo));
+    struct obuf o = { 0 };
+    size_t clen = 0, outstanding = 0;
+    int client = -1, wsum = 0;
+    uint64_t start, t, last = 0, subscribed = 0;
+    long seq = 0;
+
+    if (!sent || !kinds || !fifo)
+        return -1;
+    for (int k = 0; k < KIND_LAST; k++) {
+        wsum += weights[k];
+        if (!(lat[k] = malloc(count * sizeof(**lat))))
+            return -1;
+    }
+    if (wsum <= 0) {
+        fprintf(stderr, "the mix is empty\n");
+        return -1;
+    }
+
+    srand(1);
+    for (long i = 0; i < count; i++) {
+        int r = rand() % wsum, k = 0;
+
+        while (r >= weights[k])
+            r -= weights[k++];
+        kinds[i] = k;
+        total[k]++;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    start = t = now_us();
+
+    while (true) {
+        struct pollfd pfd[2] = {
+            { .fd = sock, .events = POLLIN | (o.len ? POLLOUT : 0) },
+            { .fd = client, .events = POLLIN },
+        };
+        struct timespec ts = { 0 };
+        uint64_t due = UINT64_MAX;
+
+        outstanding = seq;
+        for (int k = 0; k < KIND_LAST; k++)
+            outstanding -= nlat[k];
+
+        /* attach as a client once atd listens, and give it a moment to
+         * take the subscriptions before the first event */
+        if (client == -1) {
+            due = t + 10000;
+        } else if (t < subscribed) {
+            due = subscribed;
+        } else if (seq < count) {
+            due = rate > 0 ? start + (uint64_t)(seq / burst * burst * 1e6 / rate) : t;
+        } else if (outstanding == 0 || t > last + GEN_GRACE) {
+            break;
+        } else {
+            due = last + GEN_GRACE;
+        }
+
+        if (due > t)
+            ts = (struct timespec){ (due - t) / 1000000, (due - t) % 1000000 * 1000 };
+        if (due > t || o.len) {
+            if (ppoll(pfd, client == -1 ? 1 : 2, due > t ? &ts : NULL, NULL) == -1) {
+                if (errno == EINTR)
+                    continue;
+                perror("poll");
+                return -1;
+            }
+        }
+        t = now_us();
+
+        /* every command gets an OK */
+        if (pfd[0].revents & POLLIN) {
+            ssize_t ret = read(sock, in, sizeof(in));
+            if (ret <= 0) {
+                fprintf(stderr, "atd went away\n");
+                break;
+            }
+            for (ssize_t i = 0; i < ret; i++) {
+                if (in[i] == '\r' && oput(&o, "\r\nOK\r\n", 6) == -1)
+                    return -1;
+            }
+        }
+
+        if (client == -1) {
+            client = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (connect(client, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                close(client);
+                client = -1;
+            } else {
+                atd_cmd_call_events(client);
+                atd_cmd_sms_events(client);
+                fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+                subscribed = t + 100000;
+            }
+        } else if (pfd[1].revents & POLLIN) {
+            ssize_t ret = read(client, cbuf + clen, sizeof(cbuf) - clen);
+            if (ret <= 0) {
+                fprintf(stderr, "atd dropped the client\n");
+                break;
+            }
+            clen += ret;
+            ret = take_events(cbuf, clen, t, sent, count, kinds, lat, nlat, fifo, &fifohead, fifotail);
+            if (ret == -1) {
+                fprintf(stderr, "garbled event stream\n");
+                return -1;
+            }
+            memmove(cbuf, cbuf + ret, clen - ret);
+            clen -= ret;
+            last = t;
+        }
+
+        /* at full speed, only as fast as atd takes them */
+        if (client != -1 && t >= subscribed && seq < count && t >= due &&
+            (rate > 0 || o.len < 64 * BUFSIZE)) {
+            for (int b = 0; b < burst && seq < count; b++, seq++) {
+                if (put_event(&o, kinds[seq], seq) == -1)
+                    return -1;
+                if (kinds[seq] == KIND_NOCARRIER)
+                    fifo[fifotail++] = seq;
+                sent[seq] = t;
+            }
+            last = t;
+        }
+
+        if (o.len) {
+            ssize_t ret = write(sock, o.buf, o.len);
+            if (ret == -1 && errno != EAGAIN) {
+                perror("write");
+                break;
+            }
+            if (ret > 0) {
+                memmove(o.buf, o.buf + ret, o.len - ret);
+                o.len -= ret;
+            }
+        }
+
+        if (o.len > GEN_BACKLOG) {
+            fprintf(stderr, "atd fell %zu bytes behind, stopping\n", o.len);
+            break;
+        }
+    }
+
+    outstanding = seq;
+    for (int k = 0; k < KIND_LAST; k++)
+        outstanding -= nlat[k];
+
+    double secs = (last - start) / 1e6;
+    size_t sms = nlat[KIND_CMT] + nlat[KIND_UCS2] + nlat[KIND_CONCAT] + nlat[KIND_LONG];
+
+    printf("sent %ld events in %.3f s, %.0f/s in bursts of %d\n", seq, secs, seq / secs, burst);
+    printf("delivered %.0f messages/s, %zu events never arrived\n", sms / secs, outstanding);
+    for (int k = 0; k < KIND_LAST; k++) {
+        if (total[k])
+            print_latency(kind_names[k], lat[k], nlat[k], total[k]);
+    }
+
+    if (client != -1)
+        close(client);
+    for (int k = 0; k < KIND_LAST; k++)
+        free(lat[k]);
+    free(sent);
+    free(kinds);
+    free(fifo);
+    free(o.buf);
+    return outstanding ? -1 : 0;
+}
+
+/* Scenario mode. A scenario file makes atsim a modem that answers on its
+ * own, one line per directive:
+ *
+ *   # comment
+ *   on ATD*                  rule for the commands matching the pattern
+ *   after 0 \r\nOK\r\n       its responses, each sent ms after the command
+ *   on AT+CMGS=*
+ *   after 20 \r\n>\s
+ *   on *\z                   a PDU, which ends in Ctrl-Z instead of \r
+ *   after 1500 \r\n+CMGS: %r\r\n\r\nOK\r\n
+ *   on *
+ *   after 0 \r\nOK\r\n
+ *   at 2000 \r\nRING\r\n     sent once, ms after atd connected
+ *   every 10000 \r\nRING\r\n sent every ms from then on
+ *
+ * Rules are tried in order and the first match wins; '*' matches any run
+ * of characters. Texts take the escapes \r, \n, \z (Ctrl-Z), \s (a space
+ * that survives editors) and \\, and %r for the next message reference,
+ * %1 for what the first '*' matched and %% in responses. Every connection
+ * gets its own references and events, so several atds can be driven at
+ * once. */
+#define SIM_CONNS 16
+#define SIM_LINE_MAX 2048
+
+struct action {
+    uint64_t delay; /* us */
+    char *text;
+};
+
+struct rule {
+    char *pattern;
+    struct action *acts;
+    int nacts;
+};
+
+struct event {
+    uint64_t at; /* us after connecting */
+    uint64_t every; /* 0 to send once */
+    char *text;
+};
+
+struct conn {
+    int fd; /* -1 when the slot is free */
+    unsigned gen; /* bumped on close, so what was due for it is dropped */
+    char in[SIM_LINE_MAX];
+    size_t inlen;
+    struct obuf out;
+    size_t outoff;
+    int ref; /* the next +CMGS reference */
+};
+
+/* a response or event due for a connection */
+struct pending {
+    uint64_t due;
+    unsigned long seq; /* keeps what is due at once in order */
+    int conn;
+    unsigned gen;
+    const struct event *ev; /* or the response in data */
+    char *data;
+    size_t len;
+};
+
+struct sim {
+    struct rule *rules;
+    int nrules;
+    struct event *events;
+    int nevents;
+    struct conn conns[SIM_CONNS];
+    struct pending *heap;
+    size_t n, cap;
+    unsigned long seq;
+};
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+/* decodes the escapes of a scenario text in place */
+static void
+unescape(char *s)
+{
+    char *d = s;
+
+    for (; *s; s++) {
+        if (*s != '\\' || !s[1]) {
+            *d++ = *s;
+            continue;
+        }
+        switch (*++s) {
+        case 'r': *d++ = '\r'; break;
+        case 'n': *d++ = '\n'; break;
+        case 'z': *d++ = '\x1a'; break;
+        case 's': *d++ = ' '; break;
+        case '\\': *d++ = '\\'; break;
+        default:
+            *d++ = '\\';
+            *d++ = *s;
+            break;
+        }
+    }
+    *d = '\0';
+}
+
+/* Matches the len bytes at s against pattern. What the first '*' took is
+ * returned in cap and caplen, if they aren't NULL. */
+static bool
+glob(const char *p, const char *s, const char *end, const char **cap, size_t *caplen)
+{
+    for (; *p; p++, s++) {
+        if (*p == '*') {
+            for (const char *t = s; t <= end; t++) {
+                if (glob(p + 1, t, end, NULL, NULL)) {
+                    if (cap) {
+                        *cap = s;
+                        *caplen = t - s;
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+        if (s == end || *p != *s)
+            return false;
+    }
+
+    return s == end;
+}
+
+/* appends text to o with its % sequences replaced */
+static int
+expand(struct obuf *o, const char *text, const char *cap, size_t caplen, int *ref)
+{
+    char num[16];
+
+    while (*text) {
+        size_t n = strcspn(text, "%");
+
+        if (oput(o, text, n) == -1)
+            return -1;
+        text += n;
+        if (!*text)
+            break;
+
+        switch (text[1]) {
+        case 'r':
+            n = snprintf(num, sizeof(num), "%d", *ref);
+            *ref = (*ref + 1) & 0xff;
+            if (oput(o, num, n) == -1)
+                return -1;
+            break;
+        case '1':
+            if (oput(o, cap, caplen) == -1)
+                return -1;
+            break;
+        case '%':
+            if (oput(o, "%", 1) == -1)
+                return -1;
+            break;
+        default:
+            if (oput(o, text, text[1] ? 2 : 1) == -1)
+                return -1;
+            break;
+        }
+        text += text[1] ? 2 : 1;
+    }
+
+    return 0;
+}
+
+static int
+load_scenario(struct sim *sim, const char *path)
+{
+    char line[SIM_LINE_MAX];
+    FILE *f;
+    int lineno = 0;
+
+    if (!(f = fopen(path, "r"))) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line + strspn(line, " \t"), *word, *end;
+        double ms = 0;
+        size_t len;
+
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!*p || *p == '#')
+            continue;
+
+        word = p;
+        len = strcspn(p, " \t");
+        p += len;
+        p += strspn(p, " \t");
+
+        if (len != 2 || memcmp(word, "on", 2)) {
+            ms = strtod(p, &end);
+            if (end == p || ms < 0 || (*end != ' ' && *end != '\t'))
+                goto bad;
+            p = end + strspn(end, " \t");
+        }
+        if (!*p)
+            goto bad;
+        if (!(p = strdup(p))) {
+            fclose(f);
+            return -1;
+        }
+        unescape(p);
+
+        if (len == 2 && !memcmp(word, "on", 2)) {
+            struct rule *r = realloc(sim->rules, (sim->nrules + 1) * sizeof(*r));
+
+            if (!r)
+                goto nomem;
+            sim->rules = r;
+            /* trailing blanks are almost never meant to be matched */
+            for (len = strlen(p); len && (p[len - 1] == ' ' || p[len - 1] == '\t'); len--)
+                p[len - 1] = '\0';
+            r[sim->nrules++] = (struct rule){ p, NULL, 0 };
+        } else if (len == 5 && !memcmp(word, "after", 5)) {
+            struct rule *r = sim->nrules ? &sim->rules[sim->nrules - 1] : NULL;
+            struct action *a;
+
+            if (!r) {
+                free(p);
+                fprintf(stderr, "%s:%d: after without a rule\n", path, lineno);
+                fclose(f);
+                return -1;
+            }
+            if (!(a = realloc(r->acts, (r->nacts + 1) * sizeof(*a))))
+                goto nomem;
+            r->acts = a;
+            a[r->nacts++] = (struct action){ ms * 1000, p };
+        } else if ((len == 2 && !memcmp(word, "at", 2)) ||
+                   (len == 5 && !memcmp(word, "every", 5))) {
+            struct event *e = realloc(sim->events, (sim->nevents + 1) * sizeof(*e));
+
+            if (!e)
+                goto nomem;
+            sim->events = e;
+            if (len == 5 && ms == 0) {
+                free(p);
+                goto bad;
+            }
+            e[sim->nevents++] = (struct event){ ms * 1000, len == 5 ? ms * 1000 : 0, p };
+        } else {
+            free(p);
+            goto bad;
+        }
+        continue;
+    nomem:
+        free(p);
+        fprintf(stderr, "out of memory\n");
+        fclose(f);
+        return -1;
+    bad:
+        fprintf(stderr, "%s:%d: expected on pattern, after ms text, at ms text or "
+                "every ms text\n", path, lineno);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    return 0;
+}
+
+static bool
+pending_before(const struct pending *a, const struct pending *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static int
+sched_push(struct sim *sim, struct pending p)
+{
+    size_t i;
+
+    if (sim->n == sim->cap) {
+        size_t cap = sim->cap ? 2 * sim->cap : 64;
+        struct pending *heap = realloc(sim->heap, cap * sizeof(*heap));
+
+        if (!heap)
+            return -1;
+        sim->heap = heap;
+        sim->cap = cap;
+    }
+
+    p.seq = sim->seq++;
+    for (i = sim->n++; i && pending_before(&p, &sim->heap[(i - 1) / 2]); i = (i - 1) / 2)
+        sim->heap[i] = sim->heap[(i - 1) / 2];
+    sim->heap[i] = p;
+    return 0;
+}
+
+static struct pending
+sched_pop(struct sim *sim)
+{
+    struct pending top = sim->heap[0], last = sim->heap[--sim->n];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < sim->n) {
+        if (child + 1 < sim->n && pending_before(&sim->heap[child + 1], &sim->heap[child]))
+            child++;
+        if (!pending_before(&sim->heap[child], &last))
+            break;
+        sim->heap[i] = sim->heap[child];
+        i = child;
+    }
+    if (sim->n)
+        sim->heap[i] = last;
+
+    return top;
+}
+
+/* schedules the responses of the first rule matching the command in line */
+static int
+respond(struct sim *sim, int idx, const char *line, size_t len, uint64_t now)
+{
+    static struct obuf tmp;
+    struct conn *c = &sim->conns[idx];
+
+    for (int i = 0; i < sim->nrules; i++) {
+        const struct rule *r = &sim->rules[i];
+        const char *cap = line;
+        size_t caplen = 0;
+
+        if (!glob(r->pattern, line, line + len, &cap, &caplen))
+            continue;
+
+        for (int j = 0; j < r->nacts; j++) {
+            struct pending p = { .due = now + r->acts[j].delay, .conn = idx, .gen = c->gen };
+
+            tmp.len = 0;
+            if (expand(&tmp, r->acts[j].text, cap, caplen, &c->ref) == -1 ||
+                !(p.data = malloc(tmp.len)))
+                return -1;
+            memcpy(p.data, tmp.buf, tmp.len);
+            p.len = tmp.len;
+            if (sched_push(sim, p) == -1) {
+                free(p.data);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    fprintf(stderr, "%d: no rule for %.*s\n", idx, (int)len, line);
+    return 0;
+}
+
+static void
+conn_close(struct sim *sim, int idx)
+{
+    struct conn *c = &sim->conns[idx];
+
+    fprintf(stderr, "%d: atd disconnected\n", idx);
+    close(c->fd);
+    c->fd = -1;
+    c->gen++;
+}
+
+static int
+conn_accept(struct sim *sim, int sock, uint64_t now)
+{
+    int fd = accept(sock, NULL, NULL), idx;
+
+    if (fd == -1)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+    for (idx = 0; idx < SIM_CONNS && sim->conns[idx].fd != -1; idx++)
+        ;
+    if (idx == SIM_CONNS) {
+        fprintf(stderr, "too many connections, closing the new one\n");
+        close(fd);
+        return 0;
+    }
+
+    struct conn *c = &sim->conns[idx];
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c->fd = fd;
+    c->inlen = 0;
+    c->out.len = c->outoff = 0;
+    c->ref = 0;
+    fprintf(stderr, "%d: atd connected\n", idx);
+
+    for (int i = 0; i < sim->nevents; i++) {
+        struct pending p = {
+            .due = now + sim->events[i].at,
+            .conn = idx,
+            .gen = c->gen,
+            .ev = &sim->events[i],
+        };
+
+        if (sched_push(sim, p) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* hands what is due by now to the connections */
+static int
+fire(struct sim *sim, uint64_t now)
+{
+    while (sim->n && sim->heap[0].due <= now) {
+        struct pending p = sched_pop(sim);
+        struct conn *c = &sim->conns[p.conn];
+        bool live = c->fd != -1 && c->gen == p.gen;
+
+        if (live && p.ev) {
+            /* events nobody reads are dropped rather than piled up */
+            if (c->out.len - c->outoff < GEN_BACKLOG &&
+                expand(&c->out, p.ev->text, NULL, 0, &c->ref) == -1)
+                return -1;
+            if (p.ev->every) {
+                p.due += p.ev->every;
+                if (sched_push(sim, p) == -1)
+                    return -1;
+            }
+        } else if (live && oput(&c->out, p.data, p.len) == -1) {
+            free(p.data);
+            return -1;
+        }
+        free(p.data);
+    }
+
+    return 0;
+}
+
+/* splits what came from atd into commands, which end in \r, or in Ctrl-Z
+ * after a prompt */
+static int
+conn_read(struct sim *sim, int idx, uint64_t now)
+{
+    struct conn *c = &sim->conns[idx];
+    char buf[BUFSIZE];
+    ssize_t ret = read(c->fd, buf, sizeof(buf));
+
+    if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    if (ret <= 0) {
+        conn_close(sim, idx);
+        return 0;
+    }
+
+    for (ssize_t i = 0; i < ret; i++) {
+        if (buf[i] == '\r' || buf[i] == '\x1a') {
+            if (buf[i] == '\x1a' && c->inlen < sizeof(c->in))
+                c->in[c->inlen++] = buf[i];
+            if (c->inlen && respond(sim, idx, c->in, c->inlen, now) == -1)
+                return -1;
+            c->inlen = 0;
+        } else if ((buf[i] != '\n' || c->inlen) && c->inlen < sizeof(c->in)) {
+            c->in[c->inlen++] = buf[i];
+        }
+    }
+
+    return 0;
+}
+
+static void
+conn_write(struct sim *sim, int idx)
+{
+    struct conn *c = &sim->conns[idx];
+    /* a closed atd shows up as EPIPE, not as a signal */
+    ssize_t ret = send(c->fd, c->out.buf + c->outoff, c->out.len - c->outoff, MSG_NOSIGNAL);
+
+    if (ret == -1) {
+        if (errno != EINTR && errno != EAGAIN)
+            conn_close(sim, idx);
+        return;
+    }
+
+    c->outoff += ret;
+    if (c->outoff == c->out.len)
+        c->out.len = c->outoff = 0;
+}
+
+/* Plays the modem described by the scenario at path to every atd that
+ * connects to sock, until SIGINT or SIGTERM. */
+static int
+simulate(int sock, const char *path)
+{
+    struct sim sim = { 0 };
+    struct pollfd pfds[SIM_CONNS + 1];
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigset_t mask, orig;
+    int ret = 0;
+
+    if (load_scenario(&sim, path) == -1)
+        return -1;
+
+    for (int i = 0; i < SIM_CONNS; i++)
+        sim.conns[i].fd = -1;
+
+    /* only let the signals in while waiting, so none is missed */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &orig);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fprintf(stderr, "%d rules, %d events, waiting for atd\n", sim.nrules, sim.nevents);
+    while (!stop) {
+        uint64_t now = now_us();
+        struct timespec ts, *timeout = NULL;
+        int n = 0;
+
+        if (fire(&sim, now) == -1) {
+            fprintf(stderr, "out of memory\n");
+            ret = -1;
+            break;
+        }
+        if (sim.n) {
+            uint64_t wait = sim.heap[0].due - now;
+            ts = (struct timespec){ wait / 1000000, wait % 1000000 * 1000 };
+            timeout = &ts;
+        }
+
+        pfds[n++] = (struct pollfd){ .fd = sock, .events = POLLIN };
+        for (int i = 0; i < SIM_CONNS; i++) {
+            struct conn *c = &sim.conns[i];
+
+            pfds[n++] = (struct pollfd){
+                .fd = c->fd,
+                .events = POLLIN | (c->out.len > c->outoff ? POLLOUT : 0),
+            };
+        }
+
+        if (ppoll(pfds, n, timeout, &orig) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            ret = -1;
+            break;
+        }
+
+        now = now_us();
+        for (int i = 0; i < SIM_CONNS; i++) {
+            short revents = pfds[i + 1].revents;
+
+            if (sim.conns[i].fd == -1)
+                continue;
+            if (revents & POLLOUT)
+                conn_write(&sim, i);
+            if (sim.conns[i].fd != -1 && revents & (POLLIN | POLLHUP | POLLERR) &&
+                conn_read(&sim, i, now) == -1) {
+                fprintf(stderr, "out of memory\n");
+                stop = 1;
+                ret = -1;
+            }
+        }
+
+        if (pfds[0].revents & POLLIN && conn_accept(&sim, sock, now) == -1) {
+            perror("accept");
+            ret = -1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < SIM_CONNS; i++) {
+        if (sim.conns[i].fd != -1)
+            close(sim.conns[i].fd);
+        free(sim.conns[i].out.buf);
+    }
+    while (sim.n)
+        free(sched_pop(&sim).data);
+    for (int i = 0; i < sim.nrules; i++) {
+        for (int j = 0; j < sim.rules[i].nacts; j++)
+            free(sim.rules[i].acts[j].text);
+        free(sim.rules[i].acts);
+        free(sim.rules[i].pattern);
+    }
+    for (int i = 0; i < sim.nevents; i++)
+        free(sim.events[i].text);
+    free(sim.rules);
+    free(sim.events);
+    free(sim.heap);
+    sigprocmask(SIG_SETMASK, &orig, NULL);
+
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
     struct sockaddr_un sockaddr = {
         .sun_family = AF_UNIX,
         .sun_path = "/tmp/atsim",
@@ -33,6 +1270,53 @@ int main() {
     ssize_t tocount = 0;
     ssize_t fromcount = 0;
 
+    char *tracepath = NULL, *scenario = NULL;
+    double speed = 1, rate = -1;
+    long count = 10000;
+    int burst = 1, opt;
+    int weights[KIND_LAST] = { 1, 1, 4, 1, 1, 0 };
+
+    while ((opt = getopt(argc, argv, "f:r:s:g:b:m:n:")) != -1) {
+        switch (opt) {
+        case 'f':
+            scenario = optarg;
+            break;
+        case 'g':
+            if (parse_rate(optarg, &rate) == -1)
+                goto usage;
+            break;
+        case 'b':
+            if ((burst = atoi(optarg)) < 1)
+                goto usage;
+            break;
+        case 'm':
+            memset(weights, 0, sizeof(weights));
+            if (parse_mix(optarg, weights) == -1)
+                goto usage;
+            break;
+        case 'n':
+            count = atol(optarg);
+            if (count < 1 || count > 10000000)
+                goto usage;
+            break;
+        case 'r':
+            tracepath = optarg;
+            break;
+        case 's':
+            if (parse_rate(optarg, &speed) == -1) {
+                fprintf(stderr, "speed must be a positive factor or max\n");
+                return 1;
+            }
+            break;
+        default:
+        usage:
+            fprintf(stderr, "usage: %s [-r trace [-s speed|max]]\n"
+                    "       %s -g rate|max [-b burst] [-n count] [-m kind=weight,...]\n"
+                    "       %s -f scenario\n", argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+
     if (sock == -1) {
         fprintf(stderr, "failed to create socket\n");
     }
@@ -42,17 +1326,33 @@ int main() {
         goto err;
     }
 
-    if (listen(sock, 1)  != 0) {
+    if (listen(sock, SIM_CONNS) != 0) {
         fprintf(stderr, "failed to listen on socket\n");
         goto err;
     }
 
+    if (scenario) {
+        int ret = simulate(sock, scenario);
+        close(sock);
+        unlink(sockaddr.sun_path);
+        return ret == -1;
+    }
+
     fds[SOCKFD].fd = accept(sock, NULL, NULL);
     if (fds[SOCKFD].fd == -1) {
         fprintf(stderr, "failed to accept connection\n");
         goto err;
     }
 
+    if (tracepath || rate >= 0) {
+        int ret = tracepath ? replay(fds[SOCKFD].fd, tracepath, speed) :
+                  generate(fds[SOCKFD].fd, count, rate, burst, weights);
+        close(fds[SOCKFD].fd);
+        close(sock);
+        unlink(sockaddr.sun_path);
+        return ret == -1;
+    }
+
     fds[SOCKFD].events = POLLIN;
     fds[STDIN].fd = 1;
     fds[STDIN].events = POLLIN;
@@ -0,0 +1,756 @@
+/* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "at.h"
+#include "atd.h"
+#include "hex.h"
+#include "log.h"
+#include "pdu.h"
+#include "util.h"
+
+char *argv0;
+
+/* counts allocations, so codec changes can be held to a fixed number */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+static long allocs;
+
+void *
+malloc(size_t n)
+{
+	allocs++;
+	return __libc_malloc(n);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	allocs++;
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t n)
+{
+	allocs++;
+	return __libc_realloc(p, n);
+}
+
+/* keeps the compiler from optimizing away work whose result is unused */
+volatile long sink;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, long iters, double secs)
+{
+	printf("%-32s %10.1f ns/op %12.0f ops/s\n", name, secs * 1e9 / iters, iters / secs);
+}
+
+static void
+report_bytes(const char *name, long iters, size_t bytes, double secs)
+{
+	printf("%-32s %10.1f ns/op %12.1f MB/s\n", name, secs * 1e9 / iters,
+	       (double)bytes * iters / secs / 1e6);
+}
+
+static const char *clip_lines[] = {
+	"+CLIP: \"+15551234567\",145,,,,0",
+	"+CLIP: \"5551234\",129,\"\",0,\"Alice\",0",
+	"+COLP: \"+442071234567\",145",
+};
+
+#define URC_ITERS 2000000
+
+static void
+bench_urc_sscanf(void)
+{
+	char number[PHONE_NUMBER_MAX_LEN + 1];
+	double t = now();
+
+	for (long i = 0; i < URC_ITERS; i++) {
+		const char *line = clip_lines[i % LEN(clip_lines)];
+
+		if (sscanf(line + 7, "\"%15[+1234567890ABCD]\"", number) == 1)
+			sink += number[1];
+	}
+
+	report("urc fields, sscanf", URC_ITERS, now() - t);
+}
+
+static void
+bench_urc_fields(void)
+{
+	char number[PHONE_NUMBER_MAX_LEN + 1];
+	struct at_field f[6];
+	size_t lens[LEN(clip_lines)];
+	double t;
+
+	for (size_t i = 0; i < LEN(clip_lines); i++)
+		lens[i] = strlen(clip_lines[i]);
+
+	t = now();
+	for (long i = 0; i < URC_ITERS; i++) {
+		const char *line = clip_lines[i % LEN(clip_lines)];
+
+		if (at_fields(line, lens[i % LEN(clip_lines)], f, LEN(f)) >= 2 &&
+		    f[0].type == AT_FIELD_STRING && f[0].len <= PHONE_NUMBER_MAX_LEN) {
+			memcpy(number, f[0].s, f[0].len);
+			number[f[0].len] = '\0';
+			sink += number[1] + f[1].n;
+		}
+	}
+
+	report("urc fields, at_fields", URC_ITERS, now() - t);
+}
+
+/* Compares what the selected kernel makes of bin against the scalar one's
+ * text, for every length up to a few vectors and for all of bin: encoding
+ * has to give the same text, decoding has to give bin back and reject a
+ * stray character wherever it is. Returns the number of mismatches. */
+static int
+hex_check(const char *impl, const unsigned char *bin, size_t size, const char *ref)
+{
+	static unsigned char out[1 << 20];
+	static char text[2 << 20];
+	int failed = 0;
+
+	for (size_t i = 0; i <= 101; i++) {
+		size_t n = i <= 100 ? i : size;
+
+		hex_encode(text, bin, n);
+		if (memcmp(text, ref, 2 * n)) {
+			fprintf(stderr, "hex encode %zu, %s: differs from scalar\n", n, impl);
+			failed++;
+		}
+		if (hex_decode(out, ref, n) != 0 || memcmp(out, bin, n)) {
+			fprintf(stderr, "hex decode %zu, %s: doesn't round trip\n", n, impl);
+			failed++;
+		}
+		if (n > 0 && i <= 100) {
+			memcpy(text, ref, 2 * n);
+			text[2 * n - 1 - n % 2] = 'g';
+			if (hex_decode(out, text, n) != -1) {
+				fprintf(stderr, "hex decode %zu, %s: took invalid input\n", n, impl);
+				failed++;
+			}
+		}
+	}
+
+	return failed;
+}
+
+/* a PDU-sized and a large buffer, bytes/s are counted on the binary side */
+static void
+bench_hex(void)
+{
+	static const size_t sizes[] = { 176, 1 << 20 };
+	static unsigned char bin[1 << 20];
+	static char text[2 << 20], ref[2 << 20];
+	char name[64];
+	int failed = 0;
+
+	for (size_t i = 0; i < sizeof(bin); i++)
+		bin[i] = i * 2654435761u >> 13;
+
+	hex_select(HEX_SCALAR);
+	hex_encode(ref, bin, sizeof(bin));
+	for (int impl = HEX_SCALAR; impl < HEX_LAST; impl++) {
+		if (hex_select(impl) == 0)
+			failed += hex_check(hex_impl_names[impl], bin, sizeof(bin), ref);
+	}
+
+	for (size_t s = 0; s < LEN(sizes); s++) {
+		long iters = (256L << 20) / sizes[s];
+
+		for (int impl = HEX_SCALAR; impl < HEX_LAST; impl++) {
+			double t;
+
+			if (hex_select(impl) < 0)
+				continue;
+
+			t = now();
+			for (long i = 0; i < iters; i++)
+				hex_encode(text, bin, sizes[s]);
+			snprintf(name, sizeof(name), "hex encode %zu, %s", sizes[s], hex_impl_names[impl]);
+			report_bytes(name, iters, sizes[s], now() - t);
+
+			t = now();
+			for (long i = 0; i < iters; i++)
+				sink += hex_decode(bin, text, sizes[s]);
+			snprintf(name, sizeof(name), "hex decode %zu, %s", sizes[s], hex_impl_names[impl]);
+			report_bytes(name, iters, sizes[s], now() - t);
+		}
+	}
+
+	hex_select(HEX_BEST);
+	if (failed)
+		exit(1);
+}
+
+/* the septet decoder as it was before pdu_decode_7bit(), minus its
+ * per-character fprintf, to compare against */
+static int
+put_unicode_char(char *dest, uint16_t c)
+{
+	if (c < 0x80) {
+		*dest = c;
+		return 1;
+	} else if (c < 0x800) {
+		*(dest++) = 0xc0 | ((c >> 6) & 0x1f);
+		*dest = 0x80 | (c & 0x3f);
+		return 2;
+	} else {
+		*(dest++) = 0xe0 | ((c >> 12) & 0xf);
+		*(dest++) = 0x80 | ((c >> 6) & 0x3f);
+		*dest = 0x80 | (c & 0x3f);
+		return 3;
+	}
+}
+
+static int
+old_decode_7bit_char(char *dest, int len, unsigned char c, bool *escape)
+{
+	uint16_t conv_0x20[] = {
+		0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+		0x00F2, 0x00E7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+		0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+		0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+	};
+	uint16_t conv_0x5b[] = {
+		0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7, 0x00BF,
+	};
+	uint16_t conv_0x7b[] = {
+		0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0
+	};
+	int cur_len = 0;
+	uint16_t outc;
+
+	dest += len;
+	if (*escape) {
+		*escape = false;
+		switch(c) {
+		case 0x0A: *dest = 0x0C; return 1;
+		case 0x14: *dest = 0x5E; return 1;
+		case 0x28: *dest = 0x7B; return 1;
+		case 0x29: *dest = 0x7D; return 1;
+		case 0x2F: *dest = 0x5C; return 1;
+		case 0x3C: *dest = 0x5B; return 1;
+		case 0x3D: *dest = 0x7E; return 1;
+		case 0x3E: *dest = 0x5D; return 1;
+		case 0x40: *dest = 0x7C; return 1;
+		case 0x65:
+			outc = 0x20AC;
+			goto out;
+		case 0x1B:
+			goto normal;
+		default:
+			*(dest++) = conv_0x20[0x1B];
+			cur_len++;
+			goto normal;
+		}
+	}
+
+	if (c == 0x1b) {
+		*escape = true;
+		return 0;
+	}
+
+normal:
+	if (c < 0x20)
+		outc = conv_0x20[(int) c];
+	else if (c == 0x40)
+		outc = 0x00A1;
+	else if (c >= 0x5b && c <= 0x60)
+		outc = conv_0x5b[c - 0x5b];
+	else if (c >= 0x7b && c <= 0x7f)
+		outc = conv_0x7b[c - 0x7b];
+	else
+		outc = c;
+
+out:
+	return cur_len + put_unicode_char(dest, outc);
+}
+
+static int
+old_decode_7bit_str(char *dest, const unsigned char *data, int count, int skip)
+{
+	bool escape = false;
+	int len = 0;
+
+	for (int i = skip; i < count; i++) {
+		int bit = i * 7, shift = bit % 8;
+		unsigned int c = data[bit / 8] >> shift;
+
+		if (shift > 1)
+			c |= data[bit / 8 + 1] << (8 - shift);
+
+		len += old_decode_7bit_char(dest, len, c & 0x7f, &escape);
+	}
+	dest[len] = 0;
+	return len;
+}
+
+/* packs septets the way they are sent, returns the number of octets */
+static int
+pack_7bit(unsigned char *dest, const unsigned char *septets, int count)
+{
+	int len = (count * 7 + 7) / 8;
+
+	memset(dest, 0, len);
+	for (int i = 0; i < count; i++) {
+		int bit = i * 7;
+
+		dest[bit / 8] |= septets[i] << (bit % 8);
+		if (bit % 8 > 1)
+			dest[bit / 8 + 1] |= septets[i] >> (8 - bit % 8);
+	}
+
+	return len;
+}
+
+#define SEPTET_ITERS 2000000
+
+/* 160 septets of mostly ASCII text with some accents and escapes */
+static void
+bench_7bit(void)
+{
+	unsigned char septets[UD_SEPTETS_MAX], packed[140];
+	char out[MSG_DATA_MAX];
+	double t;
+
+	for (int i = 0; i < UD_SEPTETS_MAX; i++) {
+		septets[i] = 0x20 + (i * 37) % 0x5b;
+		if (i % 23 == 5)
+			septets[i] = 0x1B;
+	}
+	pack_7bit(packed, septets, UD_SEPTETS_MAX);
+
+	t = now();
+	for (long i = 0; i < SEPTET_ITERS; i++)
+		sink += old_decode_7bit_str(out, packed, UD_SEPTETS_MAX, 0);
+	report("7bit 160 septets, old", SEPTET_ITERS, now() - t);
+
+	t = now();
+	for (long i = 0; i < SEPTET_ITERS; i++)
+		sink += pdu_decode_7bit(out, packed, UD_SEPTETS_MAX, 0);
+	report("7bit 160 septets, pdu_decode", SEPTET_ITERS, now() - t);
+}
+
+#define UCS2_ITERS 2000000
+
+/* 70 code units of Cyrillic and of ASCII, and encoding a message that
+ * fits GSM 7-bit and one that needs UCS2 */
+static void
+bench_ucs2(void)
+{
+	static const char *texts[] = {
+		"The quick brown fox jumps over the lazy dog, then naps in the sun.",
+		"Съешь же ещё этих мягких французских булок, да выпей чаю. Спасибо!",
+	};
+	unsigned char ud[UD_OCTETS_MAX];
+	char out[MSG_DATA_MAX], pdu[PDU_OCTETS_MAX], name[64];
+	double t;
+
+	for (size_t i = 0; i < LEN(texts); i++) {
+		int udl = 0;
+
+		/* UTF-16BE of texts[i], which are all in the BMP */
+		for (const unsigned char *p = (const unsigned char *)texts[i]; *p && udl < UD_OCTETS_MAX; udl += 2) {
+			unsigned int cp = *p < 0x80 ? *p++ : (p += 2, (p[-2] & 0x1f) << 6 | (p[-1] & 0x3f));
+
+			ud[udl] = cp >> 8;
+			ud[udl + 1] = cp;
+		}
+
+		t = now();
+		for (long j = 0; j < UCS2_ITERS; j++)
+			sink += pdu_decode_ucs2(out, ud, udl);
+		snprintf(name, sizeof(name), "ucs2 decode %d octets, %s", udl, i ? "cyr" : "ascii");
+		report_bytes(name, UCS2_ITERS, udl, now() - t);
+
+		t = now();
+		for (long j = 0; j < UCS2_ITERS; j++) {
+			struct pdu_segment seg;
+
+			pdu_split(texts[i], &seg, 1);
+			sink += encode_pdu(pdu, "+15551234567", &seg, 0, 1, 1);
+		}
+		snprintf(name, sizeof(name), "encode_pdu, %s", i ? "ucs2" : "gsm");
+		report(name, UCS2_ITERS, now() - t);
+	}
+}
+
+#define LOG_ITERS 2000000
+#define LOG_BURSTS 200
+
+/* a URC handler that parses a line and logs it, the way atd used to with
+ * an unbuffered fprintf to stderr, through the log ring, with the
+ * category turned off at runtime, and with the call compiled out */
+static int
+urc_step(long i, struct at_field *f, const size_t *lens)
+{
+	const char *line = clip_lines[i % LEN(clip_lines)];
+
+	return at_fields(line, lens[i % LEN(clip_lines)], f, 6) + line[1];
+}
+
+static void
+bench_log(void)
+{
+	struct at_field f[6];
+	size_t lens[LEN(clip_lines)];
+	FILE *null;
+	int fd;
+	double t;
+
+	for (size_t i = 0; i < LEN(clip_lines); i++)
+		lens[i] = strlen(clip_lines[i]);
+
+	if ((fd = open("/dev/null", O_WRONLY)) == -1 || !(null = fdopen(dup(fd), "w")))
+		die("failed to open /dev/null:");
+	setvbuf(null, NULL, _IONBF, 0);
+
+	t = now();
+	for (long i = 0; i < LOG_ITERS; i++)
+		sink += urc_step(i, f, lens);
+	report("urc loop, no logging", LOG_ITERS, now() - t);
+
+	t = now();
+	for (long i = 0; i < LOG_ITERS; i++) {
+		sink += urc_step(i, f, lens);
+		fprintf(null, "got %s\n", clip_lines[i % LEN(clip_lines)]);
+	}
+	report("urc loop, fprintf unbuffered", LOG_ITERS, now() - t);
+
+	if (log_init(fd) == -1)
+		die("failed to start logging:");
+
+	/* in bursts that fit the ring, letting the writer catch up in
+	 * between, so that every message is formatted and queued */
+	double busy = 0;
+	long n = 0;
+	for (int burst = 0; burst < LOG_BURSTS; burst++) {
+		t = now();
+		for (int j = 0; j < LOG_SLOTS / 2; j++, n++) {
+			sink += urc_step(n, f, lens);
+			log_info(LOG_AT, "got %s", clip_lines[n % LEN(clip_lines)]);
+		}
+		busy += now() - t;
+		log_flush();
+	}
+	report("urc loop, log ring", n, busy);
+	if (log_dropped())
+		printf("  %lu of %ld messages dropped\n", log_dropped(), n);
+
+	log_parse("at=warn");
+	t = now();
+	for (long i = 0; i < LOG_ITERS; i++) {
+		sink += urc_step(i, f, lens);
+		log_info(LOG_AT, "got %s", clip_lines[i % LEN(clip_lines)]);
+	}
+	report("urc loop, category off", LOG_ITERS, now() - t);
+	log_parse("debug");
+
+	t = now();
+	for (long i = 0; i < LOG_ITERS; i++) {
+		sink += urc_step(i, f, lens);
+		log_debug(LOG_AT, "got %s", clip_lines[i % LEN(clip_lines)]);
+	}
+	report(LOG_DEBUG > LOG_LEVEL ? "urc loop, compiled out" : "urc loop, debug (compiled in)",
+	       LOG_ITERS, now() - t);
+
+	log_stop();
+	fclose(null);
+	close(fd);
+}
+
+/* The corpus: every text to every number as SMS-SUBMITs, and from every
+ * sender, numbers and alphanumeric ones, as SMS-DELIVERs. */
+static const char *corpus_texts[] = {
+	"See you at 5pm, bring the keys!",
+	"Escapes: {braces} [brackets] ~tilde^ |pipe| \\backslash \u20ac5",
+	"GSM accents: \u00e0\u00e8\u00e9\u00ec\u00f2\u00f9 \u00c4\u00d6\u00d1\u00dc\u00a7\u00bf",
+	"\u041f\u0440\u0438\u0432\u0435\u0442! \u041a\u0430\u043a \u0434\u0435\u043b\u0430?",
+	"Emoji \U0001F44B\U0001F642 need UCS2",
+	/* long ones are sent in segments with a concatenation header */
+	"Lorem ipsum dolor sit amet, consectetur adipiscing elit [sed] do eiusmod tempor "
+	"incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud "
+	"exercitation {ullamco} laboris nisi ut aliquip ex ea commodo consequat. Duis aute "
+	"irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla "
+	"pariatur. Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia "
+	"deserunt mollit anim id est laborum. \u20ac\u20ac\u20ac",
+	"\u0421\u044a\u0435\u0448\u044c \u0436\u0435 \u0435\u0449\u0451 \u044d\u0442\u0438\u0445 "
+	"\u043c\u044f\u0433\u043a\u0438\u0445 \u0444\u0440\u0430\u043d\u0446\u0443\u0437\u0441\u043a"
+	"\u0438\u0445 \u0431\u0443\u043b\u043e\u043a, \u0434\u0430 \u0432\u044b\u043f\u0435\u0439 "
+	"\u0447\u0430\u044e. \u0421\u044a\u0435\u0448\u044c \u0436\u0435 \u0435\u0449\u0451 "
+	"\u044d\u0442\u0438\u0445 \u043c\u044f\u0433\u043a\u0438\u0445 \u0444\u0440\u0430\u043d"
+	"\u0446\u0443\u0437\u0441\u043a\u0438\u0445 \u0431\u0443\u043b\u043e\u043a, \u0434\u0430 "
+	"\u0432\u044b\u043f\u0435\u0439 \u0447\u0430\u044e.",
+};
+
+/* international and national, with even and odd numbers of digits */
+static const char *corpus_numbers[] = {
+	"+15551234567", "+4915112345678", "+1555123", "5551234", "12345",
+};
+
+static const char *corpus_alnum[] = { "Bank", "InfoSMS", "Paket@DHL", "ABCDEFGHIJK" };
+
+#define CORPUS_SUBMIT (LEN(corpus_texts) * LEN(corpus_numbers))
+#define CORPUS_DELIVER (LEN(corpus_texts) * (LEN(corpus_numbers) + LEN(corpus_alnum)))
+#define CORPUS_SEGS 8 /* most segments a corpus text takes */
+#define CORPUS_ITERS 20000
+
+struct corpus_msg {
+	const char *text;
+	const char *addr;
+	int nsegs;
+	int ref;
+	char hex[CORPUS_SEGS][2 * PDU_OCTETS_MAX + 1];
+};
+
+static struct corpus_msg submits[CORPUS_SUBMIT], delivers[CORPUS_DELIVER];
+
+static int
+corpus_fill(struct corpus_msg *m, const char *text, const char *addr, int ref, bool deliver)
+{
+	struct pdu_segment segs[CORPUS_SEGS];
+	unsigned char pdu[PDU_OCTETS_MAX];
+
+	m->text = text;
+	m->addr = addr;
+	m->ref = ref;
+	m->nsegs = pdu_split(text, segs, CORPUS_SEGS);
+	if (m->nsegs < 0)
+		return -1;
+
+	for (int i = 0; i < m->nsegs; i++) {
+		int len = deliver ? encode_deliver((char *)pdu, addr, &segs[i], ref, i + 1, m->nsegs) :
+		                    encode_pdu((char *)pdu, addr, &segs[i], ref, i + 1, m->nsegs);
+		int count = deliver ? encode_deliver(NULL, addr, &segs[i], ref, i + 1, m->nsegs) :
+		                      encode_pdu(NULL, addr, &segs[i], ref, i + 1, m->nsegs);
+
+		/* counting alone has to agree with encoding */
+		if (len != count || len > PDU_OCTETS_MAX)
+			return -1;
+		hex_encode(m->hex[i], pdu, len);
+		m->hex[i][2 * len] = '\0';
+	}
+
+	return 0;
+}
+
+/* decodes every segment of m and puts the text back together, returns the
+ * number of mismatches */
+static int
+corpus_check(const struct corpus_msg *m)
+{
+	static char text[CORPUS_SEGS * MSG_DATA_MAX];
+	struct pdu_msg msg;
+	size_t n = 0;
+
+	for (int i = 0; i < m->nsegs; i++) {
+		const struct sms_deliver_msg *d = &msg.d.d;
+
+		if (decode_pdu(&msg, m->hex[i], strlen(m->hex[i])) < 0 ||
+		    strcmp(d->sender.number, m->addr))
+			return 1;
+		if (m->nsegs > 1 && (!d->udhi || d->udh.ref != m->ref ||
+		                     d->udh.parts != m->nsegs || d->udh.part != i + 1))
+			return 1;
+
+		size_t l = strlen(d->msg.data);
+		memcpy(text + n, d->msg.data, l);
+		n += l;
+	}
+	text[n] = '\0';
+
+	return strcmp(text, m->text) != 0;
+}
+
+/* Parses the SMS-SUBMITs of m by hand: first octet, message reference,
+ * destination, PID, DCS, UDL against what follows and the concatenation
+ * header. Their user data has to be that of the DELIVERs of the same
+ * segments, which corpus_check() decodes. Returns the number of segments
+ * that don't match. */
+static int
+submit_check(const struct corpus_msg *m)
+{
+	struct pdu_segment segs[CORPUS_SEGS];
+	unsigned char pdu[PDU_OCTETS_MAX], dlv[PDU_OCTETS_MAX];
+	const char *num = m->addr + (m->addr[0] == '+');
+	size_t digits = strlen(num);
+	int failed = 0;
+
+	if (pdu_split(m->text, segs, CORPUS_SEGS) != m->nsegs)
+		return m->nsegs;
+
+	for (int i = 0; i < m->nsegs; i++) {
+		const struct pdu_segment *seg = &segs[i];
+		bool udh = m->nsegs > 1;
+		size_t n = strlen(m->hex[i]) / 2, a = 4 + (digits + 1) / 2, ud, k;
+		int udl, len;
+
+		if (hex_decode(pdu, m->hex[i], n) < 0 || n < a + 3 ||
+		    pdu[0] != (udh ? 0x41 : 0x01) || pdu[1] != 0 || pdu[2] != digits ||
+		    pdu[3] != (m->addr[0] == '+' ? 0x91 : 0x81)) {
+			failed++;
+			continue;
+		}
+
+		/* swapped semi-octets, padded with 0xF */
+		for (k = 0; k < digits; k++) {
+			if ((k % 2 ? pdu[4 + k / 2] >> 4 : pdu[4 + k / 2] & 0xf) != num[k] - '0')
+				break;
+		}
+		if (k < digits || (digits % 2 && pdu[a - 1] >> 4 != 0xf) ||
+		    pdu[a] != 0 || pdu[a + 1] != seg->dcs) {
+			failed++;
+			continue;
+		}
+
+		udl = pdu[a + 2];
+		ud = a + 3;
+		if (seg->dcs == DCS_GSM) {
+			if (udl != seg->udl + (udh ? UDH_CONCAT_SEPTETS : 0) ||
+			    (size_t)(udl * 7 + 7) / 8 != n - ud) {
+				failed++;
+				continue;
+			}
+		} else if (udl != seg->udl + (udh ? UDH_CONCAT_LEN : 0) || (size_t)udl != n - ud) {
+			failed++;
+			continue;
+		}
+
+		if (udh && (pdu[ud] != UDH_CONCAT_LEN - 1 || pdu[ud + 1] != 0 || pdu[ud + 2] != 3 ||
+		            pdu[ud + 3] != (m->ref & 0xff) || pdu[ud + 4] != m->nsegs ||
+		            pdu[ud + 5] != i + 1)) {
+			failed++;
+			continue;
+		}
+
+		/* the UDL and user data end both PDUs */
+		len = encode_deliver((char *)dlv, m->addr, seg, m->ref, i + 1, m->nsegs);
+		if ((size_t)len < n - a - 2 || memcmp(dlv + len - (n - a - 2), pdu + a + 2, n - a - 2))
+			failed++;
+	}
+
+	return failed;
+}
+
+static void
+bench_corpus(void)
+{
+	struct pdu_segment segs[CORPUS_SEGS];
+	char pdu[PDU_OCTETS_MAX];
+	size_t nsub = 0, ndel = 0, subsegs = 0, delsegs = 0, octets = 0;
+	int failed = 0;
+	long a;
+	double t;
+
+	for (size_t i = 0; i < LEN(corpus_texts); i++) {
+		for (size_t j = 0; j < LEN(corpus_numbers); j++, nsub++) {
+			if (corpus_fill(&submits[nsub], corpus_texts[i], corpus_numbers[j], nsub, false) < 0)
+				die("failed to encode corpus text %zu to %s", i, corpus_numbers[j]);
+			subsegs += submits[nsub].nsegs;
+		}
+		for (size_t j = 0; j < LEN(corpus_numbers) + LEN(corpus_alnum); j++, ndel++) {
+			const char *addr = j < LEN(corpus_numbers) ? corpus_numbers[j] :
+			                   corpus_alnum[j - LEN(corpus_numbers)];
+
+			if (corpus_fill(&delivers[ndel], corpus_texts[i], addr, ndel, true) < 0)
+				die("failed to encode corpus text %zu from %s", i, addr);
+			delsegs += delivers[ndel].nsegs;
+			for (int k = 0; k < delivers[ndel].nsegs; k++)
+				octets += strlen(delivers[ndel].hex[k]) / 2;
+		}
+	}
+
+	for (size_t i = 0; i < nsub; i++) {
+		if (submit_check(&submits[i])) {
+			fprintf(stderr, "submit check failed: text %zu to %s\n",
+			        i / LEN(corpus_numbers), submits[i].addr);
+			failed++;
+		}
+	}
+	for (size_t i = 0; i < ndel; i++) {
+		if (corpus_check(&delivers[i])) {
+			fprintf(stderr, "round trip failed: text %zu from %s\n",
+			        i / (LEN(corpus_numbers) + LEN(corpus_alnum)), delivers[i].addr);
+			failed++;
+		}
+	}
+	printf("corpus: %zu submits in %zu segments, %zu delivers in %zu segments, "
+	       "%zu checks failed\n", nsub, subsegs, ndel, delsegs, (size_t)failed);
+
+	/* the way atd sends a message: split, then encode each segment */
+	size_t subbytes = 0;
+	a = allocs;
+	t = now();
+	for (long it = 0; it < CORPUS_ITERS; it++) {
+		const struct corpus_msg *m = &submits[it % nsub];
+		int n = pdu_split(m->text, segs, CORPUS_SEGS);
+
+		for (int k = 0; k < n; k++)
+			subbytes += encode_pdu(pdu, m->addr, &segs[k], m->ref, k + 1, n);
+	}
+	t = now() - t;
+	report("encode_pdu, corpus messages", CORPUS_ITERS, t);
+	printf("  %.1f MB/s of PDU, %.2f allocations per message\n",
+	       subbytes / t / 1e6, (double)(allocs - a) / CORPUS_ITERS);
+
+	/* every segment as it comes after a +CMT */
+	struct pdu_msg msg;
+	size_t delbytes = 0;
+	long ndec = 0;
+	a = allocs;
+	t = now();
+	for (long it = 0; it < CORPUS_ITERS; it++) {
+		const struct corpus_msg *m = &delivers[it % ndel];
+
+		for (int k = 0; k < m->nsegs; k++, ndec++) {
+			size_t len = strlen(m->hex[k]);
+
+			sink += decode_pdu(&msg, m->hex[k], len);
+			delbytes += len / 2;
+		}
+	}
+	t = now() - t;
+	report("decode_pdu, corpus segments", ndec, t);
+	printf("  %.1f MB/s of PDU, %.0f messages/s, %.2f allocations per message\n",
+	       delbytes / t / 1e6, CORPUS_ITERS / t, (double)(allocs - a) / CORPUS_ITERS);
+
+	if (failed)
+		exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	argv0 = argv[0];
+
+	bench_urc_sscanf();
+	bench_urc_fields();
+	bench_hex();
+	bench_7bit();
+	bench_ucs2();
+	bench_corpus();
+	bench_log();
+
+	return 0;
+}
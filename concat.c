@@ -0,0 +1,182 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "log.h"
+#include "pdu.h"
+#include "concat.h"
+
+struct segment {
+	char text[MSG_DATA_MAX];
+	uint8_t part;
+	int next; /* next part of the set, or next free segment */
+};
+
+struct set {
+	bool used;
+	char sender[NUMBER_MAX];
+	uint16_t ref;
+	uint8_t parts;
+	uint8_t received;
+	long first; /* when the first part arrived */
+	int head; /* segments, ordered by part */
+};
+
+static struct segment segments[CONCAT_SEGMENTS];
+static struct set sets[CONCAT_SETS];
+static int freesegs = -1;
+static int nfresh; /* segments that have never been used */
+
+/* room for the text of every segment */
+static char text[CONCAT_SEGMENTS * (MSG_DATA_MAX - 1) + 1];
+
+static int
+segalloc(void)
+{
+	int i = freesegs;
+
+	if (i != -1)
+		freesegs = segments[i].next;
+	else if (nfresh < CONCAT_SEGMENTS)
+		i = nfresh++;
+
+	return i;
+}
+
+/* delivers the parts of s that have arrived, in order, and frees it */
+static int
+flush(struct set *s, concat_fn deliver)
+{
+	size_t len = 0;
+	int i, next;
+
+	if (s->received < s->parts)
+		log_info(LOG_SMS, "concat: delivering %d of %d parts from %s",
+		         s->received, s->parts, s->sender);
+
+	for (i = s->head; i != -1; i = next) {
+		size_t n = strlen(segments[i].text);
+
+		memcpy(text + len, segments[i].text, n);
+		len += n;
+		next = segments[i].next;
+		segments[i].next = freesegs;
+		freesegs = i;
+	}
+	text[len] = 0;
+	s->used = false;
+
+	return deliver(s->sender, text);
+}
+
+/* the set that has been waiting longest, of those with parts to deliver */
+static struct set *
+oldest(void)
+{
+	struct set *o = NULL;
+
+	for (int i = 0; i < CONCAT_SETS; i++) {
+		if (sets[i].used && sets[i].head != -1 && (!o || sets[i].first < o->first))
+			o = &sets[i];
+	}
+
+	return o;
+}
+
+static struct set *
+find(const struct sms_deliver_msg *msg)
+{
+	for (int i = 0; i < CONCAT_SETS; i++) {
+		struct set *s = &sets[i];
+
+		if (s->used && s->ref == msg->udh.ref && s->parts == msg->udh.parts &&
+		    strcmp(s->sender, msg->sender.number) == 0)
+			return s;
+	}
+
+	return NULL;
+}
+
+/* Delivers msg, or keeps it until the other parts of its message have
+ * arrived. now is a monotonic time in ms. */
+int
+concat_add(const struct sms_deliver_msg *msg, long now, concat_fn deliver)
+{
+	struct set *s;
+	int seg, *link, ret = 0;
+
+	if (!msg->udhi || msg->udh.parts < 2 || msg->udh.part < 1 ||
+	    msg->udh.part > msg->udh.parts || msg->udh.parts > CONCAT_SEGMENTS)
+		return deliver(msg->sender.number, msg->msg.data);
+
+	if (!(s = find(msg))) {
+		for (s = sets; s < sets + CONCAT_SETS && s->used; s++)
+			;
+
+		if (s == sets + CONCAT_SETS) {
+			s = oldest();
+			ret = flush(s, deliver);
+		}
+
+		s->used = true;
+		strcpy(s->sender, msg->sender.number);
+		s->ref = msg->udh.ref;
+		s->parts = msg->udh.parts;
+		s->received = 0;
+		s->first = now;
+		s->head = -1;
+	}
+
+	for (link = &s->head; *link != -1 && segments[*link].part < msg->udh.part;)
+		link = &segments[*link].next;
+
+	if (*link != -1 && segments[*link].part == msg->udh.part) {
+		log_info(LOG_SMS, "concat: duplicate part %d from %s", msg->udh.part, s->sender);
+		return ret;
+	}
+
+	/* make room by delivering the oldest message, which might be this one */
+	while ((seg = segalloc()) == -1) {
+		struct set *o = oldest();
+
+		if (flush(o, deliver) < 0)
+			ret = -1;
+		if (o == s)
+			return concat_add(msg, now, deliver) < 0 ? -1 : ret;
+	}
+
+	strcpy(segments[seg].text, msg->msg.data);
+	segments[seg].part = msg->udh.part;
+	segments[seg].next = *link;
+	*link = seg;
+
+	if (++s->received == s->parts && flush(s, deliver) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+/* Delivers what has arrived of the messages that timed out. Returns the
+ * ms until the next one times out, or -1 if none are waiting. */
+long
+concat_expire(long now, concat_fn deliver)
+{
+	long next = -1;
+
+	for (int i = 0; i < CONCAT_SETS; i++) {
+		struct set *s = &sets[i];
+
+		if (!s->used)
+			continue;
+
+		if (now - s->first >= CONCAT_TIMEOUT) {
+			flush(s, deliver);
+		} else if (next == -1 || s->first + CONCAT_TIMEOUT - now < next) {
+			next = s->first + CONCAT_TIMEOUT - now;
+		}
+	}
+
+	return next;
+}
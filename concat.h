@@ -0,0 +1,22 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef CONCAT_H
+#define CONCAT_H
+
+/* Reassembles the parts of concatenated messages. Everything lives in
+ * fixed pools: at most CONCAT_SETS messages are waiting for parts, with
+ * CONCAT_SEGMENTS parts between them. When either runs out, the oldest
+ * message is delivered with the parts it has, and so is one whose last
+ * part hasn't arrived after CONCAT_TIMEOUT ms. */
+#define CONCAT_SETS 16
+#define CONCAT_SEGMENTS 64
+#define CONCAT_TIMEOUT (5 * 60 * 1000)
+
+struct sms_deliver_msg;
+
+/* delivers a complete message, returns -1 on failure */
+typedef int (*concat_fn)(const char *sender, const char *text);
+
+int concat_add(const struct sms_deliver_msg *msg, long now, concat_fn deliver);
+long concat_expire(long now, concat_fn deliver);
+
+#endif /* CONCAT_H */
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -9,7 +10,7 @@
 static unsigned short
 dec_short(char *in)
 {
-    return in[0] + (in[1] << 8);
+    return (unsigned char)in[0] + ((unsigned char)in[1] << 8);
 }
 
 static unsigned short
@@ -19,12 +20,33 @@ enc_short(char *buf, unsigned short num)
     buf[1] = num >> 8;
 }
 
+static uint32_t
+dec_long(char *in)
+{
+    return dec_short(in) + ((uint32_t)dec_short(in + 2) << 16);
+}
+
+static void
+enc_long(char *buf, uint32_t num)
+{
+    enc_short(buf, num);
+    enc_short(buf + 2, num >> 16);
+}
+
+/* returns the number of bytes decoded, 0 if avail doesn't hold the whole
+ * string yet, or -1 if allocation fails */
 ssize_t
-dec_str(char *in, char **out)
+dec_str(char *in, size_t avail, char **out)
 {
     unsigned short len;
     char *ptr = in;
+    if (avail < 2)
+        return 0;
+
     len = dec_short(in);
+    if (avail < len + 2)
+        return 0;
+
     ptr += 2;
 
     *out = malloc(len+1);
@@ -32,7 +54,7 @@ dec_str(char *in, char **out)
         return -1;
 
     memcpy(*out, ptr, len);
-    out[len] = 0;
+    (*out)[len] = 0;
     return len + 2;
 }
 
@@ -42,7 +64,7 @@ enc_str(char *buf, char *str)
     size_t len = strlen(str);
     enc_short(buf, len);
     buf += 2;
-    strcpy(buf, str);
+    memcpy(buf, str, len);
 
     return len + 2;
 }
@@ -60,6 +82,8 @@ xwrite(int fd, char *buf, size_t len)
         len -= ret;
         ptr += ret;
     }
+
+    return 0;
 }
 
 int
@@ -69,12 +93,14 @@ xread(int fd, char *buf, size_t len)
     ssize_t ret;
     while (len) {
         ret = read(fd, ptr, len);
-        if (ret == -1)
+        if (ret <= 0)
             return -1;
 
         len -= ret;
         ptr += ret;
     }
+
+    return 0;
 }
 
 int
@@ -116,6 +142,13 @@ atd_cmd_sms_events(int fd)
     return xwrite(fd, &buf, 1);
 }
 
+int
+atd_cmd_stats(int fd)
+{
+    char buf = CMD_STATS;
+    return xwrite(fd, &buf, 1);
+}
+
 int
 atd_cmd_submit(int fd, char *num, char *msg)
 {
@@ -128,28 +161,37 @@ atd_cmd_submit(int fd, char *num, char *msg)
     return xwrite(fd, buf, len);
 }
 
-int
-atd_status_delivered(int fd, char *num, char *msg)
+/* buf must have room for strlen(num) + strlen(msg) + 5 bytes */
+ssize_t
+enc_status_delivered(char *buf, char *num, char *msg)
 {
 	if (strlen(num) > PHONE_NUMBER_MAX_LEN)
 		return -1;
 
-    size_t len = strlen(num) + strlen(msg) + 5; // 5 = op + length + length
-    char buf[len];
     buf[0] = STATUS_DELIVERED;
 
     enc_str(buf + 1, num);
     enc_str(buf + 3 + strlen(num), msg);
 
-    return xwrite(fd, buf, len);
+    return strlen(num) + strlen(msg) + 5; // 5 = op + length + length
 }
 
 int
-atd_status_call(int fd, enum callstatus status, char *num)
+atd_status_delivered(int fd, char *num, char *msg)
+{
+    char buf[strlen(num) + strlen(msg) + 5];
+    ssize_t len = enc_status_delivered(buf, num, msg);
+    if (len == -1)
+        return -1;
+
+    return xwrite(fd, buf, len);
+}
+
+/* buf must have room for strlen(num) + 4 bytes */
+ssize_t
+enc_status_call(char *buf, enum callstatus status, char *num)
 {
-    char buf[4 + strlen(num)];
     char *ptr;
-    ssize_t ret;
 
     buf[0] = STATUS_CALL;
     buf[1] = status;
@@ -157,7 +199,14 @@ atd_status_call(int fd, enum callstatus status, char *num)
     ptr = buf + 2;
     ptr += enc_str(ptr, num);
 
-    return xwrite(fd, buf, ptr - buf);
+    return ptr - buf;
+}
+
+int
+atd_status_call(int fd, enum callstatus status, char *num)
+{
+    char buf[4 + strlen(num)];
+    return xwrite(fd, buf, enc_status_call(buf, status, num));
 }
 
 /* calls should be MAX_CALLS long */
@@ -194,7 +243,6 @@ dec_call_status(int fd, struct call *call)
 int
 dec_sms_status(int fd, struct sms *sms)
 {
-    char status = 0;
     unsigned short len = 0;
     ssize_t ret;
     char buf[PHONE_NUMBER_MAX_LEN];
@@ -229,3 +277,120 @@ dec_sms_status(int fd, struct sms *sms)
 
     return 0;
 }
+
+/* only the buckets from the first to the last nonzero one are sent */
+static size_t
+enc_hist(char *buf, const uint32_t *hist)
+{
+    int lo = 0, hi = STATS_BUCKETS;
+    char *ptr = buf + 2;
+
+    while (lo < hi && !hist[lo])
+        lo++;
+    while (hi > lo && !hist[hi - 1])
+        hi--;
+
+    buf[0] = lo;
+    buf[1] = hi;
+    for (int i = lo; i < hi; i++, ptr += 4)
+        enc_long(ptr, hist[i]);
+
+    return ptr - buf;
+}
+
+/* [0] = STATUS_STATS
+   [1] = PRIO_LAST, followed by that many shorts of queued commands
+   clients as a short, then backend_in, backend_out and client_in as longs
+   ATLAST and STATS_BUCKETS as bytes, then for every enum atcmd sent, ok and
+   error as longs and the wait and service histograms, each as the bytes lo
+   and hi followed by the longs of buckets lo to hi-1
+   buf must have room for STATS_MSG_MAX bytes */
+ssize_t
+enc_status_stats(char *buf, const struct stats *st)
+{
+    char *ptr = buf;
+
+    *ptr++ = STATUS_STATS;
+    *ptr++ = PRIO_LAST;
+    for (int p = 0; p < PRIO_LAST; p++, ptr += 2)
+        enc_short(ptr, st->queued[p]);
+    enc_short(ptr, st->clients);
+    enc_long(ptr + 2, st->backend_in);
+    enc_long(ptr + 6, st->backend_out);
+    enc_long(ptr + 10, st->client_in);
+    ptr += 14;
+
+    *ptr++ = ATLAST;
+    *ptr++ = STATS_BUCKETS;
+    for (int c = 0; c < ATLAST; c++) {
+        const struct cmdstats *cs = &st->cmds[c];
+
+        enc_long(ptr, cs->sent);
+        enc_long(ptr + 4, cs->ok);
+        enc_long(ptr + 8, cs->error);
+        ptr += 12;
+        ptr += enc_hist(ptr, cs->wait);
+        ptr += enc_hist(ptr, cs->service);
+    }
+
+    return ptr - buf;
+}
+
+static int
+dec_hist(int fd, uint32_t *hist)
+{
+    char buf[4 * STATS_BUCKETS];
+    unsigned char range[2];
+
+    memset(hist, 0, STATS_BUCKETS * sizeof(*hist));
+    if (xread(fd, (char *)range, 2) == -1 || range[0] > range[1] || range[1] > STATS_BUCKETS)
+        return -1;
+
+    if (xread(fd, buf, 4 * (range[1] - range[0])) == -1)
+        return -1;
+
+    for (int i = range[0]; i < range[1]; i++)
+        hist[i] = dec_long(buf + 4 * (i - range[0]));
+
+    return 0;
+}
+
+/* reads what follows STATUS_STATS, fails if the daemon was built with
+ * different priority classes, commands or buckets */
+int
+dec_stats(int fd, struct stats *st)
+{
+    char buf[2 * PRIO_LAST + 16];
+    unsigned char n;
+
+    if (xread(fd, (char *)&n, 1) == -1 || n != PRIO_LAST)
+        return -1;
+
+    if (xread(fd, buf, 2 * PRIO_LAST + 14) == -1)
+        return -1;
+
+    for (int p = 0; p < PRIO_LAST; p++)
+        st->queued[p] = dec_short(buf + 2 * p);
+    st->clients = dec_short(buf + 2 * PRIO_LAST);
+    st->backend_in = dec_long(buf + 2 * PRIO_LAST + 2);
+    st->backend_out = dec_long(buf + 2 * PRIO_LAST + 6);
+    st->client_in = dec_long(buf + 2 * PRIO_LAST + 10);
+
+    if (xread(fd, buf, 2) == -1 || buf[0] != ATLAST || buf[1] != STATS_BUCKETS)
+        return -1;
+
+    for (int c = 0; c < ATLAST; c++) {
+        struct cmdstats *cs = &st->cmds[c];
+
+        if (xread(fd, buf, 12) == -1)
+            return -1;
+        cs->sent = dec_long(buf);
+        cs->ok = dec_long(buf + 4);
+        cs->error = dec_long(buf + 8);
+
+        if (dec_hist(fd, cs->wait) == -1 || dec_hist(fd, cs->service) == -1)
+            return -1;
+    }
+
+    return 0;
+}
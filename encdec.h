@@ -1,13 +1,22 @@
+/* the largest enc_status_stats() can get, with every bucket sent */
+#define STATS_MSG_MAX (2 + 2 * PRIO_LAST + 14 + 2 + \
+                       ATLAST * (12 + 2 * (2 + 4 * STATS_BUCKETS)))
+
 int atd_cmd_dial(int fd, char *num);
 int atd_cmd_hangup(int fd);
 int atd_cmd_answer(int fd);
 int atd_cmd_call_events(int fd);
 int atd_cmd_sms_events(int fd);
 int atd_cmd_submit(int fd, char *num, char *msg);
+int atd_cmd_stats(int fd);
+ssize_t enc_status_call(char *buf, enum callstatus status, char *num);
+ssize_t enc_status_delivered(char *buf, char *num, char *msg);
 int atd_status_call(int fd, enum callstatus status, char *num);
 int atd_status_delivered(int fd, char *num, char *msg);
-ssize_t dec_str(char *in, char **out);
+ssize_t dec_str(char *in, size_t avail, char **out);
 int dec_call_status(int fd, struct call *calls);
 int dec_sms_status(int fd, struct sms *sms);
+ssize_t enc_status_stats(char *buf, const struct stats *st);
+int dec_stats(int fd, struct stats *st);
 int xwrite(int fd, char *buf, size_t len);
 int xread(int fd, char *buf, size_t len);
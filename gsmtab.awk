@@ -0,0 +1,90 @@
+# See LICENSE file for copyright and license details.
+# generates gsmtab.h from gsm0338.txt
+function hex(s,    i, n) {
+	s = toupper(substr(s, 3))
+	n = 0
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789ABCDEF", substr(s, i, 1)) - 1
+	return n
+}
+
+function utf8(cp) {
+	if (cp < 128)
+		return sprintf("\\x%02X", cp)
+	if (cp < 2048)
+		return sprintf("\\x%02X\\x%02X", 192 + int(cp / 64), 128 + cp % 64)
+	return sprintf("\\x%02X\\x%02X\\x%02X", 224 + int(cp / 4096),
+	               128 + int(cp / 64) % 64, 128 + cp % 64)
+}
+
+function utf8len(cp) {
+	return cp < 128 ? 1 : cp < 2048 ? 2 : 3
+}
+
+/^0x/ {
+	code = hex($1)
+	cp = hex($2)
+	if (code >= 256) {
+		septet = code % 256
+		if (!(septet in ext))
+			ext[septet] = cp
+		if (!(cp in rev))
+			rev[cp] = 384 + septet
+	} else {
+		if (!(code in base))
+			base[code] = cp
+		if (code != 27 && !(cp in rev))
+			rev[cp] = 256 + code
+	}
+}
+
+END {
+	print "/* generated by gsmtab.awk from gsm0338.txt, do not edit */"
+	print ""
+	print "/* UTF-8 of each septet, indexed by septet + 0x80 after an escape. The"
+	print " * escape itself is empty, escaped septets without an extension decode as"
+	print " * if they weren't escaped. */"
+	print "struct gsm_char {"
+	print "\tchar b[3];"
+	print "\tunsigned char len;"
+	print "};"
+	print ""
+	print "static const struct gsm_char gsm_utf8[256] = {"
+	for (i = 0; i < 256; i++) {
+		s = i % 128
+		if (i < 128)
+			cp = s == 27 ? -1 : base[s]
+		else
+			cp = s in ext ? ext[s] : base[s]
+		if (cp < 0)
+			printf("\t[0x%02X] = { \"\", 0 },\n", i)
+		else
+			printf("\t[0x%02X] = { \"%s\", %d },\n", i, utf8(cp), utf8len(cp))
+	}
+	print "};"
+	print ""
+	print "/* septet of each code point, with GSM_ESC if it is escaped, or 0 */"
+	print "#define GSM_VALID 0x100"
+	print "#define GSM_ESC 0x80"
+	print ""
+	for (cp in rev)
+		pages[int(cp / 256)] = 1
+	npages = 0
+	for (p = 0; p < 256; p++) {
+		if (!(p in pages))
+			continue
+		printf("static const unsigned short gsm_page%02X[256] = {\n", p)
+		for (i = 0; i < 256; i++) {
+			if ((p * 256 + i) in rev)
+				printf("\t[0x%02X] = 0x%03X,\n", i, rev[p * 256 + i])
+		}
+		print "};"
+		print ""
+	}
+	print "static const unsigned short *const gsm_pages[256] = {"
+	for (p = 0; p < 256; p++) {
+		if (p in pages)
+			printf("\t[0x%02X] = gsm_page%02X,\n", p, p)
+	}
+	print "};"
+}
@@ -0,0 +1,424 @@
+/* generated by gsmtab.awk from gsm0338.txt, do not edit */
+
+/* UTF-8 of each septet, indexed by septet + 0x80 after an escape. The
+ * escape itself is empty, escaped septets without an extension decode as
+ * if they weren't escaped. */
+struct gsm_char {
+	char b[3];
+	unsigned char len;
+};
+
+static const struct gsm_char gsm_utf8[256] = {
+	[0x00] = { "\x40", 1 },
+	[0x01] = { "\xC2\xA3", 2 },
+	[0x02] = { "\x24", 1 },
+	[0x03] = { "\xC2\xA5", 2 },
+	[0x04] = { "\xC3\xA8", 2 },
+	[0x05] = { "\xC3\xA9", 2 },
+	[0x06] = { "\xC3\xB9", 2 },
+	[0x07] = { "\xC3\xAC", 2 },
+	[0x08] = { "\xC3\xB2", 2 },
+	[0x09] = { "\xC3\x87", 2 },
+	[0x0A] = { "\x0A", 1 },
+	[0x0B] = { "\xC3\x98", 2 },
+	[0x0C] = { "\xC3\xB8", 2 },
+	[0x0D] = { "\x0D", 1 },
+	[0x0E] = { "\xC3\x85", 2 },
+	[0x0F] = { "\xC3\xA5", 2 },
+	[0x10] = { "\xCE\x94", 2 },
+	[0x11] = { "\x5F", 1 },
+	[0x12] = { "\xCE\xA6", 2 },
+	[0x13] = { "\xCE\x93", 2 },
+	[0x14] = { "\xCE\x9B", 2 },
+	[0x15] = { "\xCE\xA9", 2 },
+	[0x16] = { "\xCE\xA0", 2 },
+	[0x17] = { "\xCE\xA8", 2 },
+	[0x18] = { "\xCE\xA3", 2 },
+	[0x19] = { "\xCE\x98", 2 },
+	[0x1A] = { "\xCE\x9E", 2 },
+	[0x1B] = { "", 0 },
+	[0x1C] = { "\xC3\x86", 2 },
+	[0x1D] = { "\xC3\xA6", 2 },
+	[0x1E] = { "\xC3\x9F", 2 },
+	[0x1F] = { "\xC3\x89", 2 },
+	[0x20] = { "\x20", 1 },
+	[0x21] = { "\x21", 1 },
+	[0x22] = { "\x22", 1 },
+	[0x23] = { "\x23", 1 },
+	[0x24] = { "\xC2\xA4", 2 },
+	[0x25] = { "\x25", 1 },
+	[0x26] = { "\x26", 1 },
+	[0x27] = { "\x27", 1 },
+	[0x28] = { "\x28", 1 },
+	[0x29] = { "\x29", 1 },
+	[0x2A] = { "\x2A", 1 },
+	[0x2B] = { "\x2B", 1 },
+	[0x2C] = { "\x2C", 1 },
+	[0x2D] = { "\x2D", 1 },
+	[0x2E] = { "\x2E", 1 },
+	[0x2F] = { "\x2F", 1 },
+	[0x30] = { "\x30", 1 },
+	[0x31] = { "\x31", 1 },
+	[0x32] = { "\x32", 1 },
+	[0x33] = { "\x33", 1 },
+	[0x34] = { "\x34", 1 },
+	[0x35] = { "\x35", 1 },
+	[0x36] = { "\x36", 1 },
+	[0x37] = { "\x37", 1 },
+	[0x38] = { "\x38", 1 },
+	[0x39] = { "\x39", 1 },
+	[0x3A] = { "\x3A", 1 },
+	[0x3B] = { "\x3B", 1 },
+	[0x3C] = { "\x3C", 1 },
+	[0x3D] = { "\x3D", 1 },
+	[0x3E] = { "\x3E", 1 },
+	[0x3F] = { "\x3F", 1 },
+	[0x40] = { "\xC2\xA1", 2 },
+	[0x41] = { "\x41", 1 },
+	[0x42] = { "\x42", 1 },
+	[0x43] = { "\x43", 1 },
+	[0x44] = { "\x44", 1 },
+	[0x45] = { "\x45", 1 },
+	[0x46] = { "\x46", 1 },
+	[0x47] = { "\x47", 1 },
+	[0x48] = { "\x48", 1 },
+	[0x49] = { "\x49", 1 },
+	[0x4A] = { "\x4A", 1 },
+	[0x4B] = { "\x4B", 1 },
+	[0x4C] = { "\x4C", 1 },
+	[0x4D] = { "\x4D", 1 },
+	[0x4E] = { "\x4E", 1 },
+	[0x4F] = { "\x4F", 1 },
+	[0x50] = { "\x50", 1 },
+	[0x51] = { "\x51", 1 },
+	[0x52] = { "\x52", 1 },
+	[0x53] = { "\x53", 1 },
+	[0x54] = { "\x54", 1 },
+	[0x55] = { "\x55", 1 },
+	[0x56] = { "\x56", 1 },
+	[0x57] = { "\x57", 1 },
+	[0x58] = { "\x58", 1 },
+	[0x59] = { "\x59", 1 },
+	[0x5A] = { "\x5A", 1 },
+	[0x5B] = { "\xC3\x84", 2 },
+	[0x5C] = { "\xC3\x96", 2 },
+	[0x5D] = { "\xC3\x91", 2 },
+	[0x5E] = { "\xC3\x9C", 2 },
+	[0x5F] = { "\xC2\xA7", 2 },
+	[0x60] = { "\xC2\xBF", 2 },
+	[0x61] = { "\x61", 1 },
+	[0x62] = { "\x62", 1 },
+	[0x63] = { "\x63", 1 },
+	[0x64] = { "\x64", 1 },
+	[0x65] = { "\x65", 1 },
+	[0x66] = { "\x66", 1 },
+	[0x67] = { "\x67", 1 },
+	[0x68] = { "\x68", 1 },
+	[0x69] = { "\x69", 1 },
+	[0x6A] = { "\x6A", 1 },
+	[0x6B] = { "\x6B", 1 },
+	[0x6C] = { "\x6C", 1 },
+	[0x6D] = { "\x6D", 1 },
+	[0x6E] = { "\x6E", 1 },
+	[0x6F] = { "\x6F", 1 },
+	[0x70] = { "\x70", 1 },
+	[0x71] = { "\x71", 1 },
+	[0x72] = { "\x72", 1 },
+	[0x73] = { "\x73", 1 },
+	[0x74] = { "\x74", 1 },
+	[0x75] = { "\x75", 1 },
+	[0x76] = { "\x76", 1 },
+	[0x77] = { "\x77", 1 },
+	[0x78] = { "\x78", 1 },
+	[0x79] = { "\x79", 1 },
+	[0x7A] = { "\x7A", 1 },
+	[0x7B] = { "\xC3\xA4", 2 },
+	[0x7C] = { "\xC3\xB6", 2 },
+	[0x7D] = { "\xC3\xB1", 2 },
+	[0x7E] = { "\xC3\xBC", 2 },
+	[0x7F] = { "\xC3\xA0", 2 },
+	[0x80] = { "\x40", 1 },
+	[0x81] = { "\xC2\xA3", 2 },
+	[0x82] = { "\x24", 1 },
+	[0x83] = { "\xC2\xA5", 2 },
+	[0x84] = { "\xC3\xA8", 2 },
+	[0x85] = { "\xC3\xA9", 2 },
+	[0x86] = { "\xC3\xB9", 2 },
+	[0x87] = { "\xC3\xAC", 2 },
+	[0x88] = { "\xC3\xB2", 2 },
+	[0x89] = { "\xC3\x87", 2 },
+	[0x8A] = { "\x0C", 1 },
+	[0x8B] = { "\xC3\x98", 2 },
+	[0x8C] = { "\xC3\xB8", 2 },
+	[0x8D] = { "\x0D", 1 },
+	[0x8E] = { "\xC3\x85", 2 },
+	[0x8F] = { "\xC3\xA5", 2 },
+	[0x90] = { "\xCE\x94", 2 },
+	[0x91] = { "\x5F", 1 },
+	[0x92] = { "\xCE\xA6", 2 },
+	[0x93] = { "\xCE\x93", 2 },
+	[0x94] = { "\x5E", 1 },
+	[0x95] = { "\xCE\xA9", 2 },
+	[0x96] = { "\xCE\xA0", 2 },
+	[0x97] = { "\xCE\xA8", 2 },
+	[0x98] = { "\xCE\xA3", 2 },
+	[0x99] = { "\xCE\x98", 2 },
+	[0x9A] = { "\xCE\x9E", 2 },
+	[0x9B] = { "\xC2\xA0", 2 },
+	[0x9C] = { "\xC3\x86", 2 },
+	[0x9D] = { "\xC3\xA6", 2 },
+	[0x9E] = { "\xC3\x9F", 2 },
+	[0x9F] = { "\xC3\x89", 2 },
+	[0xA0] = { "\x20", 1 },
+	[0xA1] = { "\x21", 1 },
+	[0xA2] = { "\x22", 1 },
+	[0xA3] = { "\x23", 1 },
+	[0xA4] = { "\xC2\xA4", 2 },
+	[0xA5] = { "\x25", 1 },
+	[0xA6] = { "\x26", 1 },
+	[0xA7] = { "\x27", 1 },
+	[0xA8] = { "\x7B", 1 },
+	[0xA9] = { "\x7D", 1 },
+	[0xAA] = { "\x2A", 1 },
+	[0xAB] = { "\x2B", 1 },
+	[0xAC] = { "\x2C", 1 },
+	[0xAD] = { "\x2D", 1 },
+	[0xAE] = { "\x2E", 1 },
+	[0xAF] = { "\x5C", 1 },
+	[0xB0] = { "\x30", 1 },
+	[0xB1] = { "\x31", 1 },
+	[0xB2] = { "\x32", 1 },
+	[0xB3] = { "\x33", 1 },
+	[0xB4] = { "\x34", 1 },
+	[0xB5] = { "\x35", 1 },
+	[0xB6] = { "\x36", 1 },
+	[0xB7] = { "\x37", 1 },
+	[0xB8] = { "\x38", 1 },
+	[0xB9] = { "\x39", 1 },
+	[0xBA] = { "\x3A", 1 },
+	[0xBB] = { "\x3B", 1 },
+	[0xBC] = { "\x5B", 1 },
+	[0xBD] = { "\x7E", 1 },
+	[0xBE] = { "\x5D", 1 },
+	[0xBF] = { "\x3F", 1 },
+	[0xC0] = { "\x7C", 1 },
+	[0xC1] = { "\x41", 1 },
+	[0xC2] = { "\x42", 1 },
+	[0xC3] = { "\x43", 1 },
+	[0xC4] = { "\x44", 1 },
+	[0xC5] = { "\x45", 1 },
+	[0xC6] = { "\x46", 1 },
+	[0xC7] = { "\x47", 1 },
+	[0xC8] = { "\x48", 1 },
+	[0xC9] = { "\x49", 1 },
+	[0xCA] = { "\x4A", 1 },
+	[0xCB] = { "\x4B", 1 },
+	[0xCC] = { "\x4C", 1 },
+	[0xCD] = { "\x4D", 1 },
+	[0xCE] = { "\x4E", 1 },
+	[0xCF] = { "\x4F", 1 },
+	[0xD0] = { "\x50", 1 },
+	[0xD1] = { "\x51", 1 },
+	[0xD2] = { "\x52", 1 },
+	[0xD3] = { "\x53", 1 },
+	[0xD4] = { "\x54", 1 },
+	[0xD5] = { "\x55", 1 },
+	[0xD6] = { "\x56", 1 },
+	[0xD7] = { "\x57", 1 },
+	[0xD8] = { "\x58", 1 },
+	[0xD9] = { "\x59", 1 },
+	[0xDA] = { "\x5A", 1 },
+	[0xDB] = { "\xC3\x84", 2 },
+	[0xDC] = { "\xC3\x96", 2 },
+	[0xDD] = { "\xC3\x91", 2 },
+	[0xDE] = { "\xC3\x9C", 2 },
+	[0xDF] = { "\xC2\xA7", 2 },
+	[0xE0] = { "\xC2\xBF", 2 },
+	[0xE1] = { "\x61", 1 },
+	[0xE2] = { "\x62", 1 },
+	[0xE3] = { "\x63", 1 },
+	[0xE4] = { "\x64", 1 },
+	[0xE5] = { "\xE2\x82\xAC", 3 },
+	[0xE6] = { "\x66", 1 },
+	[0xE7] = { "\x67", 1 },
+	[0xE8] = { "\x68", 1 },
+	[0xE9] = { "\x69", 1 },
+	[0xEA] = { "\x6A", 1 },
+	[0xEB] = { "\x6B", 1 },
+	[0xEC] = { "\x6C", 1 },
+	[0xED] = { "\x6D", 1 },
+	[0xEE] = { "\x6E", 1 },
+	[0xEF] = { "\x6F", 1 },
+	[0xF0] = { "\x70", 1 },
+	[0xF1] = { "\x71", 1 },
+	[0xF2] = { "\x72", 1 },
+	[0xF3] = { "\x73", 1 },
+	[0xF4] = { "\x74", 1 },
+	[0xF5] = { "\x75", 1 },
+	[0xF6] = { "\x76", 1 },
+	[0xF7] = { "\x77", 1 },
+	[0xF8] = { "\x78", 1 },
+	[0xF9] = { "\x79", 1 },
+	[0xFA] = { "\x7A", 1 },
+	[0xFB] = { "\xC3\xA4", 2 },
+	[0xFC] = { "\xC3\xB6", 2 },
+	[0xFD] = { "\xC3\xB1", 2 },
+	[0xFE] = { "\xC3\xBC", 2 },
+	[0xFF] = { "\xC3\xA0", 2 },
+};
+
+/* septet of each code point, with GSM_ESC if it is escaped, or 0 */
+#define GSM_VALID 0x100
+#define GSM_ESC 0x80
+
+static const unsigned short gsm_page00[256] = {
+	[0x0A] = 0x10A,
+	[0x0C] = 0x18A,
+	[0x0D] = 0x10D,
+	[0x20] = 0x120,
+	[0x21] = 0x121,
+	[0x22] = 0x122,
+	[0x23] = 0x123,
+	[0x24] = 0x102,
+	[0x25] = 0x125,
+	[0x26] = 0x126,
+	[0x27] = 0x127,
+	[0x28] = 0x128,
+	[0x29] = 0x129,
+	[0x2A] = 0x12A,
+	[0x2B] = 0x12B,
+	[0x2C] = 0x12C,
+	[0x2D] = 0x12D,
+	[0x2E] = 0x12E,
+	[0x2F] = 0x12F,
+	[0x30] = 0x130,
+	[0x31] = 0x131,
+	[0x32] = 0x132,
+	[0x33] = 0x133,
+	[0x34] = 0x134,
+	[0x35] = 0x135,
+	[0x36] = 0x136,
+	[0x37] = 0x137,
+	[0x38] = 0x138,
+	[0x39] = 0x139,
+	[0x3A] = 0x13A,
+	[0x3B] = 0x13B,
+	[0x3C] = 0x13C,
+	[0x3D] = 0x13D,
+	[0x3E] = 0x13E,
+	[0x3F] = 0x13F,
+	[0x40] = 0x100,
+	[0x41] = 0x141,
+	[0x42] = 0x142,
+	[0x43] = 0x143,
+	[0x44] = 0x144,
+	[0x45] = 0x145,
+	[0x46] = 0x146,
+	[0x47] = 0x147,
+	[0x48] = 0x148,
+	[0x49] = 0x149,
+	[0x4A] = 0x14A,
+	[0x4B] = 0x14B,
+	[0x4C] = 0x14C,
+	[0x4D] = 0x14D,
+	[0x4E] = 0x14E,
+	[0x4F] = 0x14F,
+	[0x50] = 0x150,
+	[0x51] = 0x151,
+	[0x52] = 0x152,
+	[0x53] = 0x153,
+	[0x54] = 0x154,
+	[0x55] = 0x155,
+	[0x56] = 0x156,
+	[0x57] = 0x157,
+	[0x58] = 0x158,
+	[0x59] = 0x159,
+	[0x5A] = 0x15A,
+	[0x5B] = 0x1BC,
+	[0x5C] = 0x1AF,
+	[0x5D] = 0x1BE,
+	[0x5E] = 0x194,
+	[0x5F] = 0x111,
+	[0x61] = 0x161,
+	[0x62] = 0x162,
+	[0x63] = 0x163,
+	[0x64] = 0x164,
+	[0x65] = 0x165,
+	[0x66] = 0x166,
+	[0x67] = 0x167,
+	[0x68] = 0x168,
+	[0x69] = 0x169,
+	[0x6A] = 0x16A,
+	[0x6B] = 0x16B,
+	[0x6C] = 0x16C,
+	[0x6D] = 0x16D,
+	[0x6E] = 0x16E,
+	[0x6F] = 0x16F,
+	[0x70] = 0x170,
+	[0x71] = 0x171,
+	[0x72] = 0x172,
+	[0x73] = 0x173,
+	[0x74] = 0x174,
+	[0x75] = 0x175,
+	[0x76] = 0x176,
+	[0x77] = 0x177,
+	[0x78] = 0x178,
+	[0x79] = 0x179,
+	[0x7A] = 0x17A,
+	[0x7B] = 0x1A8,
+	[0x7C] = 0x1C0,
+	[0x7D] = 0x1A9,
+	[0x7E] = 0x1BD,
+	[0xA1] = 0x140,
+	[0xA3] = 0x101,
+	[0xA4] = 0x124,
+	[0xA5] = 0x103,
+	[0xA7] = 0x15F,
+	[0xBF] = 0x160,
+	[0xC4] = 0x15B,
+	[0xC5] = 0x10E,
+	[0xC6] = 0x11C,
+	[0xC7] = 0x109,
+	[0xC9] = 0x11F,
+	[0xD1] = 0x15D,
+	[0xD6] = 0x15C,
+	[0xD8] = 0x10B,
+	[0xDC] = 0x15E,
+	[0xDF] = 0x11E,
+	[0xE0] = 0x17F,
+	[0xE4] = 0x17B,
+	[0xE5] = 0x10F,
+	[0xE6] = 0x11D,
+	[0xE8] = 0x104,
+	[0xE9] = 0x105,
+	[0xEC] = 0x107,
+	[0xF1] = 0x17D,
+	[0xF2] = 0x108,
+	[0xF6] = 0x17C,
+	[0xF8] = 0x10C,
+	[0xF9] = 0x106,
+	[0xFC] = 0x17E,
+};
+
+static const unsigned short gsm_page03[256] = {
+	[0x93] = 0x113,
+	[0x94] = 0x110,
+	[0x98] = 0x119,
+	[0x9B] = 0x114,
+	[0x9E] = 0x11A,
+	[0xA0] = 0x116,
+	[0xA3] = 0x118,
+	[0xA6] = 0x112,
+	[0xA8] = 0x117,
+	[0xA9] = 0x115,
+};
+
+static const unsigned short gsm_page20[256] = {
+	[0xAC] = 0x1E5,
+};
+
+static const unsigned short *const gsm_pages[256] = {
+	[0x00] = gsm_page00,
+	[0x03] = gsm_page03,
+	[0x20] = gsm_page20,
+};
@@ -0,0 +1,310 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <string.h>
+
+#include "hex.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HEX_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HEX_SWAR_OK
+#endif
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define LANES 0x00ff00ff00ff00ffULL
+
+const char *hex_impl_names[HEX_LAST] = {
+	[HEX_BEST] = "best",
+	[HEX_SCALAR] = "scalar",
+	[HEX_SWAR] = "swar",
+	[HEX_SSE2] = "sse2",
+	[HEX_AVX2] = "avx2",
+};
+
+static const char digits[16] = "0123456789ABCDEF";
+
+/* value + 1 of each hex digit, 0 for anything else */
+static const unsigned char unhex[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+static int
+decode_scalar(unsigned char *dest, const char *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		unsigned char hi = unhex[(unsigned char)src[2*i]];
+		unsigned char lo = unhex[(unsigned char)src[2*i + 1]];
+
+		if (!hi || !lo)
+			return -1;
+		dest[i] = (hi - 1) << 4 | (lo - 1);
+	}
+
+	return 0;
+}
+
+static void
+encode_scalar(char *dest, const unsigned char *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		dest[2*i] = digits[src[i] >> 4];
+		dest[2*i + 1] = digits[src[i] & 0xf];
+	}
+}
+
+#ifdef HEX_SWAR_OK
+/* sets the high bit of every byte of w, which must all be below 0x80, that
+ * is between lo and hi */
+#define INRANGE(w, lo, hi) \
+	(((w) + (0x80 - (lo)) * ONES) & ((0x80 + (hi)) * ONES - (w)) & HIGHS)
+
+/* eight digits into four octets at a time */
+static int
+decode_swar(unsigned char *dest, const char *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		uint64_t w, digit, alpha;
+		uint32_t out;
+
+		memcpy(&w, src + 2*i, 8);
+		if (w & HIGHS)
+			return -1;
+
+		digit = INRANGE(w, '0', '9');
+		alpha = INRANGE(w | 0x20 * ONES, 'a', 'f');
+		if ((digit | alpha) != HIGHS)
+			return -1;
+
+		/* nibbles, then the two of each 16-bit lane into its low byte */
+		w = (w & 0x0f * ONES) + 9 * (alpha >> 7);
+		w = ((w & LANES) << 4) | ((w >> 8) & LANES);
+		w = (w | w >> 8) & 0x0000ffff0000ffffULL;
+		out = w | w >> 16;
+		memcpy(dest + i, &out, 4);
+	}
+
+	return decode_scalar(dest + i, src + 2*i, n - i);
+}
+
+static void
+encode_swar(char *dest, const unsigned char *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		uint32_t in;
+		uint64_t w, gt9;
+
+		memcpy(&in, src + i, 4);
+		w = in;
+		w = (w | w << 16) & 0x0000ffff0000ffffULL;
+		w = (w | w << 8) & LANES;
+		w = ((w >> 4) & 0x000f000f000f000fULL) | ((w & 0x000f000f000f000fULL) << 8);
+		gt9 = ((w + 0x76 * ONES) & HIGHS) >> 7;
+		w += '0' * ONES + 7 * gt9;
+		memcpy(dest + 2*i, &w, 8);
+	}
+
+	encode_scalar(dest + 2*i, src + i, n - i);
+}
+#endif /* HEX_SWAR_OK */
+
+#ifdef HEX_X86
+/* nibble values of 16 digits, or -1 in valid if one isn't a digit */
+__attribute__((target("sse2"))) static inline __m128i
+nibbles_sse2(__m128i c, int *valid)
+{
+	__m128i lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+	                              _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)),
+	                              _mm_cmplt_epi8(lc, _mm_set1_epi8('f' + 1)));
+
+	*valid = _mm_movemask_epi8(_mm_or_si128(digit, alpha)) == 0xffff;
+	return _mm_add_epi8(_mm_and_si128(c, _mm_set1_epi8(0x0f)),
+	                    _mm_and_si128(alpha, _mm_set1_epi8(9)));
+}
+
+__attribute__((target("sse2"))) static int
+decode_sse2(unsigned char *dest, const char *src, size_t n)
+{
+	size_t i = 0;
+	int valid;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = nibbles_sse2(_mm_loadu_si128((const __m128i *)(src + 2*i)), &valid);
+
+		if (!valid)
+			return -1;
+
+		v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 4),
+		                 _mm_srli_epi16(v, 8));
+		_mm_storel_epi64((__m128i *)(dest + i), _mm_packus_epi16(v, v));
+	}
+
+	return decode_scalar(dest + i, src + 2*i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+encode_sse2(char *dest, const unsigned char *src, size_t n)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadl_epi64((const __m128i *)(src + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		__m128i w = _mm_unpacklo_epi8(hi, _mm_and_si128(v, mask));
+		__m128i gt9 = _mm_cmpgt_epi8(w, _mm_set1_epi8(9));
+
+		w = _mm_add_epi8(w, _mm_add_epi8(_mm_set1_epi8('0'),
+		                                 _mm_and_si128(gt9, _mm_set1_epi8(7))));
+		_mm_storeu_si128((__m128i *)(dest + 2*i), w);
+	}
+
+	encode_scalar(dest + 2*i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int
+decode_avx2(unsigned char *dest, const char *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + 2*i));
+		__m256i lc = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+		__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+		                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+		__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lc, _mm256_set1_epi8('a' - 1)),
+		                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lc));
+		__m256i v;
+
+		if (_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != -1)
+			return -1;
+
+		v = _mm256_add_epi8(_mm256_and_si256(c, _mm256_set1_epi8(0x0f)),
+		                    _mm256_and_si256(alpha, _mm256_set1_epi8(9)));
+		/* hi * 16 + lo for each pair, then narrow the 16-bit lanes */
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi16(0x0110));
+		v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0xd8);
+		_mm_storeu_si128((__m128i *)(dest + i), _mm256_castsi256_si128(v));
+	}
+
+	return decode_sse2(dest + i, src + 2*i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+encode_avx2(char *dest, const unsigned char *src, size_t n)
+{
+	const __m256i mask = _mm256_set1_epi16(0x0f);
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+		__m256i w = _mm256_or_si256(_mm256_srli_epi16(v, 4),
+		                            _mm256_slli_epi16(_mm256_and_si256(v, mask), 8));
+		__m256i gt9 = _mm256_cmpgt_epi8(w, _mm256_set1_epi8(9));
+
+		w = _mm256_add_epi8(w, _mm256_add_epi8(_mm256_set1_epi8('0'),
+		                                       _mm256_and_si256(gt9, _mm256_set1_epi8(7))));
+		_mm256_storeu_si256((__m256i *)(dest + 2*i), w);
+	}
+
+	encode_sse2(dest + 2*i, src + i, n - i);
+}
+#endif /* HEX_X86 */
+
+static int decode_init(unsigned char *dest, const char *src, size_t n);
+static void encode_init(char *dest, const unsigned char *src, size_t n);
+
+static int (*decode)(unsigned char *, const char *, size_t) = decode_init;
+static void (*encode)(char *, const unsigned char *, size_t) = encode_init;
+
+/* Switches to the given implementation, HEX_BEST picks the fastest one the
+ * CPU supports. Returns -1 if impl isn't available. */
+int
+hex_select(enum hex_impl impl)
+{
+	switch (impl) {
+	case HEX_BEST:
+#ifdef HEX_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return hex_select(HEX_AVX2);
+		if (__builtin_cpu_supports("sse2"))
+			return hex_select(HEX_SSE2);
+#endif
+#ifdef HEX_SWAR_OK
+		return hex_select(HEX_SWAR);
+#else
+		return hex_select(HEX_SCALAR);
+#endif
+	case HEX_SCALAR:
+		decode = decode_scalar;
+		encode = encode_scalar;
+		return 0;
+#ifdef HEX_SWAR_OK
+	case HEX_SWAR:
+		decode = decode_swar;
+		encode = encode_swar;
+		return 0;
+#endif
+#ifdef HEX_X86
+	case HEX_SSE2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("sse2"))
+			return -1;
+		decode = decode_sse2;
+		encode = encode_sse2;
+		return 0;
+	case HEX_AVX2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		decode = decode_avx2;
+		encode = encode_avx2;
+		return 0;
+#endif
+	default:
+		return -1;
+	}
+}
+
+static int
+decode_init(unsigned char *dest, const char *src, size_t n)
+{
+	hex_select(HEX_BEST);
+	return decode(dest, src, n);
+}
+
+static void
+encode_init(char *dest, const unsigned char *src, size_t n)
+{
+	hex_select(HEX_BEST);
+	encode(dest, src, n);
+}
+
+/* decodes the 2 * n hex digits at src into n octets, returns -1 if src has
+ * something other than hex digits */
+int
+hex_decode(unsigned char *dest, const char *src, size_t n)
+{
+	return decode(dest, src, n);
+}
+
+/* writes the 2 * n uppercase hex digits of the n octets at src to dest,
+ * without a terminating NUL */
+void
+hex_encode(char *dest, const unsigned char *src, size_t n)
+{
+	encode(dest, src, n);
+}
@@ -0,0 +1,22 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef HEX_H
+#define HEX_H
+
+#include <stddef.h>
+
+enum hex_impl {
+	HEX_BEST, /* the fastest one the CPU supports */
+	HEX_SCALAR,
+	HEX_SWAR,
+	HEX_SSE2,
+	HEX_AVX2,
+	HEX_LAST,
+};
+
+extern const char *hex_impl_names[HEX_LAST];
+
+int hex_decode(unsigned char *dest, const char *src, size_t n);
+void hex_encode(char *dest, const unsigned char *src, size_t n);
+int hex_select(enum hex_impl impl);
+
+#endif /* HEX_H */
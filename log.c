@@ -0,0 +1,281 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "util.h"
+
+struct record {
+	unsigned char level;
+	unsigned char cat;
+	unsigned short len;
+	char text[LOG_MSG_MAX - 4];
+};
+
+static const char *level_names[] = { "err", "warn", "info", "debug" };
+static const char *cat_names[] = { "main", "at", "cmd", "call", "sms" };
+
+unsigned char log_levels[LOG_CATS] = {
+	LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL,
+};
+
+/* Single producer, single consumer: only the thread that called log_init()
+ * may log while the writer runs. head and tail are free running. */
+static struct record slots[LOG_SLOTS];
+static _Alignas(64) atomic_size_t head;
+static _Alignas(64) atomic_size_t tail;
+static _Alignas(64) atomic_bool sleeping;
+static size_t head_seen; /* producer's last look at head */
+static atomic_ulong dropped;
+static atomic_bool quit;
+static sem_t wake;
+static pthread_t writer;
+static bool running;
+static int logfd = 2;
+
+static void
+writeall(const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(logfd, buf, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* appends "level cat: text\n" to buf, which has room for it */
+static size_t
+format(char *buf, const struct record *r)
+{
+	size_t n = 0, l;
+
+	l = strlen(level_names[r->level]);
+	memcpy(buf, level_names[r->level], l);
+	n += l;
+	buf[n++] = ' ';
+	l = strlen(cat_names[r->cat]);
+	memcpy(buf + n, cat_names[r->cat], l);
+	n += l;
+	buf[n++] = ':';
+	buf[n++] = ' ';
+	memcpy(buf + n, r->text, r->len);
+	n += r->len;
+	buf[n++] = '\n';
+
+	return n;
+}
+
+static void
+fill(struct record *r, enum log_level level, enum log_cat cat, const char *fmt, va_list ap)
+{
+	int ret;
+
+	r->level = level;
+	r->cat = cat;
+	ret = vsnprintf(r->text, sizeof(r->text), fmt, ap);
+	if (ret < 0)
+		ret = 0;
+	r->len = MIN((size_t)ret, sizeof(r->text) - 1);
+}
+
+/* writes out everything queued in as few write()s as possible */
+static void *
+drain(void *arg)
+{
+	static char buf[16 * LOG_MSG_MAX];
+	unsigned long reported = 0;
+
+	(void)arg;
+
+	while (true) {
+		size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+		size_t t = atomic_load_explicit(&tail, memory_order_acquire);
+		unsigned long d = atomic_load_explicit(&dropped, memory_order_relaxed);
+		size_t n = 0;
+
+		if (d != reported) {
+			n += snprintf(buf, sizeof(buf), "warn main: %lu log messages dropped\n",
+			              d - reported);
+			reported = d;
+		}
+
+		if (h == t && n == 0) {
+			if (atomic_load(&quit))
+				break;
+
+			/* the producer posts only when it sees this flag, so check
+			 * the ring again after raising it */
+			atomic_store(&sleeping, true);
+			if (atomic_load(&tail) == h && !atomic_load(&quit)) {
+				sem_wait(&wake);
+				/* messages come in bursts, one per line from the
+				 * modem, so let the rest of it queue up rather than
+				 * waking once per message */
+				if (!atomic_load(&quit))
+					nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+			}
+			atomic_store(&sleeping, false);
+			continue;
+		}
+
+		for (; h != t; h++) {
+			const struct record *r = &slots[h & (LOG_SLOTS - 1)];
+
+			if (sizeof(buf) - n < LOG_MSG_MAX + 16) {
+				atomic_store_explicit(&head, h, memory_order_release);
+				writeall(buf, n);
+				n = 0;
+			}
+			n += format(buf + n, r);
+		}
+		atomic_store_explicit(&head, h, memory_order_release);
+		writeall(buf, n);
+	}
+
+	return NULL;
+}
+
+/* starts the writer thread, logging to fd. Call it with the signals the
+ * writer shouldn't see already blocked. Until then, and after log_stop(),
+ * messages are written synchronously. */
+int
+log_init(int fd)
+{
+	logfd = fd;
+	atomic_store(&quit, false);
+
+	if (sem_init(&wake, 0, 0) == -1)
+		return -1;
+
+	if ((errno = pthread_create(&writer, NULL, drain, NULL))) {
+		sem_destroy(&wake);
+		return -1;
+	}
+
+	if (!running)
+		atexit(log_stop);
+	running = true;
+
+	return 0;
+}
+
+/* writes out what is still queued and stops the writer thread */
+void
+log_stop(void)
+{
+	if (!running)
+		return;
+
+	atomic_store(&quit, true);
+	sem_post(&wake);
+	pthread_join(writer, NULL);
+	sem_destroy(&wake);
+	running = false;
+}
+
+/* "level" sets every category, "category=level" just one. Several can be
+ * given separated by commas. */
+int
+log_parse(const char *spec)
+{
+	while (*spec) {
+		size_t len = strcspn(spec, ",");
+		const char *eq = memchr(spec, '=', len);
+		const char *lvl = eq ? eq + 1 : spec;
+		size_t lvllen = len - (lvl - spec);
+		int level = -1, cat = -1;
+
+		for (size_t i = 0; i < LEN(level_names); i++) {
+			if (strlen(level_names[i]) == lvllen && !memcmp(level_names[i], lvl, lvllen))
+				level = i;
+		}
+		if (level == -1)
+			return -1;
+
+		if (eq) {
+			for (size_t i = 0; i < LEN(cat_names); i++) {
+				if (strlen(cat_names[i]) == (size_t)(eq - spec) &&
+				    !memcmp(cat_names[i], spec, eq - spec))
+					cat = i;
+			}
+			if (cat == -1)
+				return -1;
+			log_levels[cat] = level;
+		} else {
+			for (int i = 0; i < LOG_CATS; i++)
+				log_levels[i] = level;
+		}
+
+		spec += len;
+		if (*spec == ',')
+			spec++;
+	}
+
+	return 0;
+}
+
+/* waits until the writer has taken everything queued so far */
+void
+log_flush(void)
+{
+	while (running && atomic_load(&head) != atomic_load(&tail))
+		sched_yield();
+}
+
+unsigned long
+log_dropped(void)
+{
+	return atomic_load(&dropped);
+}
+
+void
+log_write(enum log_level level, enum log_cat cat, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!running) {
+		struct record r;
+		char buf[LOG_MSG_MAX + 16];
+
+		va_start(ap, fmt);
+		fill(&r, level, cat, fmt, ap);
+		va_end(ap);
+		writeall(buf, format(buf, &r));
+		return;
+	}
+
+	/* only touch the writer's cache line when the ring looks full */
+	size_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+	if (t - head_seen == LOG_SLOTS) {
+		head_seen = atomic_load_explicit(&head, memory_order_acquire);
+		if (t - head_seen == LOG_SLOTS) {
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		}
+	}
+
+	va_start(ap, fmt);
+	fill(&slots[t & (LOG_SLOTS - 1)], level, cat, fmt, ap);
+	va_end(ap);
+
+	/* sequentially consistent, so that either the writer sees the new
+	 * tail before it sleeps or we see it sleeping */
+	atomic_store(&tail, t + 1);
+	if (atomic_load_explicit(&sleeping, memory_order_seq_cst) && atomic_exchange(&sleeping, false))
+		sem_post(&wake);
+}
@@ -0,0 +1,60 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef LOG_H
+#define LOG_H
+
+/* Messages are formatted into a fixed ring of records by the caller and
+ * written out by a separate thread, so a slow console never stalls the
+ * event loop. When the ring is full, messages are dropped and counted
+ * instead of waiting.
+ *
+ * Calls below LOG_LEVEL compile to nothing. Build with
+ * -DLOG_LEVEL=LOG_DEBUG to get the per-line traces. What is compiled in
+ * can be filtered further per category at runtime with log_parse(). */
+enum log_level {
+	LOG_ERR,
+	LOG_WARN,
+	LOG_INFO,
+	LOG_DEBUG,
+};
+
+enum log_cat {
+	LOG_MAIN,
+	LOG_AT,   /* traffic with the modem */
+	LOG_CMD,  /* client requests */
+	LOG_CALL,
+	LOG_SMS,
+	LOG_CATS,
+};
+
+#ifndef LOG_LEVEL
+#ifdef DEBUG
+#define LOG_LEVEL LOG_DEBUG
+#else
+#define LOG_LEVEL LOG_INFO
+#endif
+#endif
+
+#define LOG_SLOTS 256 /* power of two */
+#define LOG_MSG_MAX 512
+
+extern unsigned char log_levels[LOG_CATS];
+
+#define LOG(level, cat, ...) do { \
+	if ((level) <= LOG_LEVEL && (level) <= log_levels[cat]) \
+		log_write(level, cat, __VA_ARGS__); \
+} while (0)
+
+#define log_err(cat, ...) LOG(LOG_ERR, cat, __VA_ARGS__)
+#define log_warn(cat, ...) LOG(LOG_WARN, cat, __VA_ARGS__)
+#define log_info(cat, ...) LOG(LOG_INFO, cat, __VA_ARGS__)
+#define log_debug(cat, ...) LOG(LOG_DEBUG, cat, __VA_ARGS__)
+
+int log_init(int fd);
+void log_stop(void);
+void log_flush(void);
+int log_parse(const char *spec);
+unsigned long log_dropped(void);
+void log_write(enum log_level level, enum log_cat cat, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#endif /* LOG_H */
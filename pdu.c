@@ -24,309 +24,212 @@
 /* If you want to see how PDU encoding works, this is the clearest,
  * most concises source that I found: https://en.wikipedia.org/wiki/GSM_03.40 */
 
-#include <assert.h>
-#include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "gsmtab.h"
+#include "hex.h"
+#include "log.h"
 #include "pdu.h"
 
-char
-atoh(char hex)
+/* timestamps are semi-octets with the digits swapped */
+static char
+bcdswap(unsigned char o)
 {
-	if (isdigit(hex)) return hex - '0';
-
-	return hex - 'A' + 0xA;
+	return (o & 0xf) * 10 + (o >> 4);
 }
 
-char *htoa(char *str, char val)
-{
-	*str = '0' + ((val >> 4) & 0xf);
-	if (*str > '9')
-		*str = 'A' - 0xA + ((val >> 4) & 0xf);
-
-	str++;
+#define GSM_ESCAPE 0x1B
 
-	*str = '0' + (val & 0xf);
-	if (*str > '9')
-		*str = 'A' - 0xA + (val & 0xf);
-
-	str++;
+/* appends the UTF-8 for septet c, which is escaped if esc is 0x80, and
+ * returns the esc for the next one */
+static inline unsigned char
+put_septet(char *dest, int *len, unsigned char c, unsigned char esc)
+{
+	const struct gsm_char *t = &gsm_utf8[esc | c];
 
-	return str;
+	memcpy(dest + *len, t->b, 3);
+	*len += t->len;
+	return (esc | c) == GSM_ESCAPE ? 0x80 : 0;
 }
 
-char
-pairtohex(char *ptr)
+/* Converts septets skip up to count of the packed septets in data to UTF-8
+ * in dest, which needs room for 2 * (count - skip) + 1 bytes: the generated
+ * table copies 3 bytes for each, but only the euro sign, which takes two
+ * septets, needs that many. data must be
+ * at least (count * 7 + 7) / 8 octets long. Every 7 octets hold 8 septets,
+ * which are taken from a single 64-bit load. */
+int
+pdu_decode_7bit(char *dest, const unsigned char *data, int count, int skip)
 {
-	assert(isxdigit(ptr[0]));
-	assert(isxdigit(ptr[1]));
+	const unsigned char *end = data + (count * 7 + 7) / 8;
+	unsigned char escape = 0;
+	int len = 0;
+	int i = skip;
 
-	return (atoh(ptr[0]) << 4) + atoh(ptr[1]);
-}
+	while (i < count) {
+		const unsigned char *p = data + i / 8 * 7;
+		uint64_t w = 0;
 
-char
-pairtohexswap(char *ptr)
-{
-	assert(isxdigit(ptr[0]));
-	assert(isxdigit(ptr[1]));
+		memcpy(&w, p, end - p >= 8 ? 8 : end - p);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		w = __builtin_bswap64(w);
+#endif
 
-	return atoh(ptr[0]) + (atoh(ptr[1]) << 4);
-}
+		if (i % 8 == 0 && i + 8 <= count) {
+			for (int k = 0; k < 8; k++)
+				escape = put_septet(dest, &len, (w >> (7 * k)) & 0x7f, escape);
+			i += 8;
+			continue;
+		}
 
-char *
-hexswap(char *dest, char *src)
-{
-	*(dest++) = src[1];
-	*(dest++) = src[0];
-	return dest;
+		for (int k = i % 8; k < 8 && i < count; k++, i++)
+			escape = put_septet(dest, &len, (w >> (7 * k)) & 0x7f, escape);
+	}
+	dest[len] = 0;
+
+	log_debug(LOG_SMS, "%s: %d septets: %s", __func__, count - skip, dest);
+	return len;
 }
 
+/* appends the UTF-8 encoding of cp to dest, returns its length */
 static int
-put_unicode_char(char *dest, uint16_t c)
+put_utf8(char *dest, uint32_t cp)
 {
-	if (c < 0x80) {
-		*dest = c;
+	if (cp < 0x80) {
+		dest[0] = cp;
 		return 1;
-	} else if (c < 0x800) {
-		*(dest++) = 0xc0 | ((c >> 6) & 0x1f);
-		*dest = 0x80 | (c & 0x3f);
+	} else if (cp < 0x800) {
+		dest[0] = 0xc0 | cp >> 6;
+		dest[1] = 0x80 | (cp & 0x3f);
 		return 2;
-	} else {
-		*(dest++) = 0xe0 | ((c >> 12) & 0xf);
-		*(dest++) = 0x80 | ((c >> 6) & 0x3f);
-		*dest = 0x80 | (c & 0x3f);
+	} else if (cp < 0x10000) {
+		dest[0] = 0xe0 | cp >> 12;
+		dest[1] = 0x80 | ((cp >> 6) & 0x3f);
+		dest[2] = 0x80 | (cp & 0x3f);
 		return 3;
 	}
-}
-
 
-static int
-pdu_decode_7bit_char(char *dest, int len, unsigned char c, bool *escape)
-{
-	uint16_t conv_0x20[] = {
-		0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
-		0x00F2, 0x00E7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
-		0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
-		0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
-	};
-	uint16_t conv_0x5b[] = {
-		0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7, 0x00BF,
-	};
-	uint16_t conv_0x7b[] = {
-		0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0
-	};
-	int cur_len = 0;
-	uint16_t outc;
-
-	fprintf(stderr, " %02x", c);
-	dest += len;
-	if (*escape) {
-		*escape = false;
-		switch(c) {
-		case 0x0A:
-			*dest = 0x0C;
-			return 1;
-		case 0x14:
-			*dest = 0x5E;
-			return 1;
-		case 0x28:
-			*dest = 0x7B;
-			return 1;
-		case 0x29:
-			*dest = 0x7D;
-			return 1;
-		case 0x2F:
-			*dest = 0x5C;
-			return 1;
-		case 0x3C:
-			*dest = 0x5B;
-			return 1;
-		case 0x3D:
-			*dest = 0x7E;
-			return 1;
-		case 0x3E:
-			*dest = 0x5D;
-			return 1;
-		case 0x40:
-			*dest = 0x7C;
-			return 1;
-		case 0x65:
-			outc = 0x20AC;
-			goto out;
-		case 0x1B:
-			goto normal;
-		default:
-			/* invalid */
-			*(dest++) = conv_0x20[0x1B];
-			cur_len++;
-			goto normal;
-		}
-	}
-
-	if (c == 0x1b) {
-		*escape = true;
-		return 0;
-	}
-
-normal:
-	if (c < 0x20)
-		outc = conv_0x20[(int) c];
-	else if (c == 0x40)
-		outc = 0x00A1;
-	else if (c >= 0x5b && c <= 0x60)
-		outc = conv_0x5b[c - 0x5b];
-	else if (c >= 0x7b && c <= 0x7f)
-		outc = conv_0x7b[c - 0x7b];
-	else
-		outc = c;
-
-out:
-	return cur_len + put_unicode_char(dest, outc);
+	dest[0] = 0xf0 | cp >> 18;
+	dest[1] = 0x80 | ((cp >> 12) & 0x3f);
+	dest[2] = 0x80 | ((cp >> 6) & 0x3f);
+	dest[3] = 0x80 | (cp & 0x3f);
+	return 4;
 }
 
-static int
-pdu_decode_7bit_str(char *dest, const unsigned char *data, int data_len, int bit_offset)
+/* Converts the len octets of UTF-16BE in data to UTF-8 in dest, which needs
+ * room for 3 * len / 2 + 1 bytes. Runs of ASCII are converted four code
+ * units at a time, unpaired surrogates come out as U+FFFD. */
+int
+pdu_decode_ucs2(char *dest, const unsigned char *data, int len)
 {
-	bool escape = false;
-	int len = 0;
-	int i;
+	const unsigned char *end = data + (len & ~1);
+	int n = 0;
 
-	fprintf(stderr, "Raw text:");
-	for (i = 0; i < data_len; i++) {
-		int pos = (i + bit_offset) % 7;
+	while (data < end) {
+		uint32_t cp;
+
+		if (end - data >= 8) {
+			uint64_t w;
+
+			/* four units in big endian, ASCII if only the low 7 bits are set */
+			memcpy(&w, data, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			if (!(w & 0x80ff80ff80ff80ffULL)) {
+#else
+			if (!(w & 0xff80ff80ff80ff80ULL)) {
+#endif
+				dest[n++] = data[1];
+				dest[n++] = data[3];
+				dest[n++] = data[5];
+				dest[n++] = data[7];
+				data += 8;
+				continue;
+			}
+		}
 
-		if (pos == 0) {
-			len += pdu_decode_7bit_char(dest, len, data[i] & 0x7f, &escape);
-		} else {
-			if (i)
-				len += pdu_decode_7bit_char(dest, len,
-				                            (data[i - 1] >> (7 + 1 - pos)) |
-				                            ((data[i] << pos) & 0x7f), &escape);
-
-			if (pos == 6)
-				len += pdu_decode_7bit_char(dest, len, (data[i] >> 1) & 0x7f,
-				                            &escape);
+		cp = data[0] << 8 | data[1];
+		data += 2;
+		if (cp >= 0xd800 && cp < 0xdc00 && end - data >= 2 &&
+		    (data[0] & 0xfc) == 0xdc) {
+			cp = 0x10000 + ((cp - 0xd800) << 10) + ((data[0] << 8 | data[1]) - 0xdc00);
+			data += 2;
+		} else if (cp >= 0xd800 && cp < 0xe000) {
+			cp = 0xfffd;
 		}
+
+		n += put_utf8(dest + n, cp);
 	}
-	dest[len] = 0;
-	fprintf(stderr, "\n");
-	return len;
-}
+	dest[n] = 0;
 
-/*
-static void decode_7bit_field(char *name, const unsigned char *data, int data_len, int bit_offset)
-{
-	char *dest = blobmsg_alloc_string_buffer(&status, name, 3 * data_len + 2);
-	pdu_decode_7bit_str(dest, data, CEILDIV(data_len * 7, 8), bit_offset);
-	dest[data_len] = 0;
-	blobmsg_add_string_buffer(&status);
+	log_debug(LOG_SMS, "%s: %d octets: %s", __func__, len, dest);
+	return n;
 }
-*/
-
-static char *pdu_add_semioctet(char *str, char val)
-{
-	*str = '0' + (val & 0xf);
-	if (*str > '9')
-		*str = 'A' - 0xA + (val & 0xf);
-
-	str++;
-
-	*str = '0' + ((val >> 4) & 0xf);
-	if (*str > '9')
-		*str = 'A' - 0xA + ((val >> 4) & 0xf);
 
-	str++;
-
-	return str;
-}
+static const char semioctets[] = "0123456789ABCDEF";
 
+/* decodes an address of ndigits semi-octets with type toa into str, which
+ * must have room for NUMBER_MAX bytes */
 static void
-pdu_decode_address(char *str, unsigned char *data, int len)
+pdu_decode_address(char *str, const unsigned char *data, int ndigits, unsigned char toa)
 {
-	unsigned char toa;
-	char *temp = str;
-
-	toa = pairtohex(data);
-	data += 2;
-	len -= 2;
 	switch (toa & 0x70) {
 	case 0x50:
-		pdu_decode_7bit_str(str, data, len, 0);
+		pdu_decode_7bit(str, data, ndigits * 4 / 7, 0);
 		return;
 	case 0x10:
 		*(str++) = '+';
 		/* fall through */
 	default:
-		while (len > 0) {
-			str = hexswap(str, data);
-			data += 2;
-			len -= 2;
-		}
-	}
-
-	if (*(str - 1) == 'F')
-		*(str - 1) = 0;
-	else
-		*str = 0;
-}
+		for (int i = 0; i < ndigits; i++) {
+			unsigned char digit = i & 1 ? data[i / 2] >> 4 : data[i / 2] & 0xf;
 
-int
-decode_ud(struct message *msg, char *raw, int len, enum dcs dcs)
-{
-	fprintf(stderr, "len = %d\n", len);
-	switch (dcs) {
-	case DCS_GSM: {
-		char *data = calloc(len, 1);
-		if (!data)
-			return -1;
-
-		int i = 0, c = 0;
-		while (c < len) {
-			data[i] = pairtohex(raw);
-			raw += 2;
-			c += 2;
-			i++;
+			/* filler for an odd number of digits */
+			if (digit == 0xf)
+				break;
+			*(str++) = semioctets[digit];
 		}
-
-		pdu_decode_7bit_str(msg->data, data, len / 2, 0);
-		free(data);
-		break;
-	}
-	default:
-		fprintf(stderr, "unknown format %d\n", dcs);
-		return -1;
 	}
 
+	*str = 0;
 }
 
-static int decode_udh(struct sms_deliver_msg *msg, const unsigned char *data)
+/* returns the number of octets taken by the header, or -1 if it doesn't
+ * fit in the len octets of user data */
+static int
+decode_udh(struct sms_deliver_msg *msg, const unsigned char *data, int len)
 {
 	const unsigned char *end;
-	unsigned int type, len, udh_len;
+	unsigned int type, vlen, udh_len;
 
-	udh_len = *(data++);
-	end = data + udh_len;
-	while (data < end) {
+	if (len < 1 || (udh_len = data[0]) + 1 > len)
+		return -1;
+
+	end = ++data + udh_len;
+	while (end - data >= 2) {
 		const unsigned char *val;
 
 		type = data[0];
-		len = data[1];
+		vlen = data[1];
 		val = &data[2];
-		data += 2 + len;
+		data += 2 + vlen;
 		if (data > end)
 			break;
 
 		switch (type) {
 		case 0x00:
+			if (vlen < 3)
+				break;
 			msg->udh.ref = val[0];
 			msg->udh.parts = val[1];
 			msg->udh.part = val[2];
 			break;
 		case 0x08:
+			if (vlen < 4)
+				break;
 			msg->udh.ref = val[0] << 8 | val[1];
 			msg->udh.parts = val[2];
 			msg->udh.part = val[3];
@@ -340,159 +243,298 @@ static int decode_udh(struct sms_deliver_msg *msg, const unsigned char *data)
 	return udh_len + 1;
 }
 
-int
-decode_sms_deliver(struct sms_deliver_msg *msg, char *raw, size_t len, char header)
+/* the alphabet is in bits 2-3 for the general data coding groups, and in
+ * bit 2 for the message class group */
+static enum dcs
+decode_dcs(unsigned char dcs)
 {
-	msg->mms = !!(header & 0x4);
-	msg->udhi = (header >> 6) & 1;
+	if ((dcs & 0xc0) == 0)
+		return dcs & 0x0c;
+	if ((dcs & 0xf0) == 0xf0)
+		return dcs & 0x04;
 
-	// TODO loop prevention, status report indication?
-	raw += 2;
-	len -= 2;
+	return dcs;
+}
 
-	msg->sender.len = pairtohex(raw);
-	fprintf(stderr, "msg->: %d\n", msg->sender.len);
-	raw += 2;
-	len -= 2;
+static int
+decode_sms_deliver(struct sms_deliver_msg *msg, const unsigned char *data, size_t len)
+{
+	const unsigned char *end = data + len;
+	unsigned char header, toa;
+	int udh_len = 0;
 
-	char *str = calloc(1, msg->sender.len * 2);
-	if (str == NULL)
+	if (len < 2)
 		return -1;
 
-	pdu_decode_address(str, raw, msg->sender.len + 2);
-
-	fprintf(stderr, "smsdeliver: %s\n", str);
+	header = *(data++);
+	msg->mms = !!(header & 0x4);
+	msg->udhi = (header >> 6) & 1;
+	memset(&msg->udh, 0, sizeof(msg->udh));
 
-	if (strlen(str) > 15) {
-		fprintf(stderr, "phone number too long\n");
+	// TODO loop prevention, status report indication?
+	msg->sender.len = *(data++);
+	if (msg->sender.len > 20 || end - data < 1 + (msg->sender.len + 1) / 2) {
+		log_warn(LOG_SMS, "bad sender address");
 		return -1;
 	}
 
-	strcpy(msg->sender.number, str);
-	free(str);
-
-	raw += 2 + (msg->sender.len & 1 ? msg->sender.len + 1 : msg->sender.len);
-	len -= 2 + (msg->sender.len & 1 ? msg->sender.len + 1 : msg->sender.len);
-	fprintf(stderr, "left: %s\n", raw);
+	toa = *(data++);
+	msg->sender.enc = toa;
+	pdu_decode_address(msg->sender.number, data, msg->sender.len, toa);
+	data += (msg->sender.len + 1) / 2;
 
-	msg->pid = pairtohex(raw);
-	raw += 2; len -= 2;
-
-	msg->dcs = pairtohex(raw);
-	raw += 2; len -= 2;
-
-	msg->date.year = pairtohexswap(raw);
-	raw += 2; len -= 2;
-
-	msg->date.month = pairtohexswap(raw);
-	raw += 2; len -= 2;
+	/* PID, DCS, timestamp and UDL */
+	if (end - data < 10)
+		return -1;
 
-	msg->date.day = pairtohexswap(raw);
-	raw += 2; len -= 2;
+	msg->pid = *(data++);
+	msg->dcs = decode_dcs(*(data++));
+	msg->date.year = bcdswap(*(data++));
+	msg->date.month = bcdswap(*(data++));
+	msg->date.day = bcdswap(*(data++));
+	msg->time.hour = bcdswap(*(data++));
+	msg->time.minute = bcdswap(*(data++));
+	msg->time.second = bcdswap(*(data++));
+	msg->time.tz = bcdswap(*data & ~0x08);
+	if (*(data++) & 0x08)
+		msg->time.tz = -msg->time.tz;
+	msg->msg.len = *(data++);
+
+	if (msg->udhi && (udh_len = decode_udh(msg, data, end - data)) < 0)
+		return -1;
 
-	msg->time.hour = pairtohex(raw);
-	raw += 2; len -= 2;
+	switch (msg->dcs) {
+	case DCS_GSM:
+		if (msg->msg.len > UD_SEPTETS_MAX || (msg->msg.len * 7 + 7) / 8 > end - data)
+			return -1;
 
-	msg->time.minute = pairtohex(raw);
-	raw += 2; len -= 2;
+		/* the text starts at the septet after the header */
+		pdu_decode_7bit(msg->msg.data, data, msg->msg.len, (udh_len * 8 + 6) / 7);
+		return 0;
+	case DCS_UCS2:
+		if (msg->msg.len > UD_OCTETS_MAX || msg->msg.len > end - data || udh_len > msg->msg.len)
+			return -1;
 
-	msg->time.second = pairtohex(raw);
-	raw += 2; len -= 2;
+		pdu_decode_ucs2(msg->msg.data, data + udh_len, msg->msg.len - udh_len);
+		return 0;
+	default:
+		log_warn(LOG_SMS, "unknown format %d", msg->dcs);
+		return -1;
+	}
+}
 
-	msg->time.tz = pairtohex(raw);
-	raw += 2; len -= 2;
+/* Decodes the len hex digits at raw, which don't need to be terminated,
+ * into pdu_msg. Everything is written to pdu_msg itself, nothing is
+ * allocated. Returns -1 if the PDU is malformed or not an SMS-DELIVER. */
+int
+decode_pdu(struct pdu_msg *pdu_msg, const char *raw, size_t len)
+{
+	unsigned char data[PDU_OCTETS_MAX];
+	size_t n = len / 2;
 
-	msg->msg.len = pairtohex(raw);
-	raw += 2; len -= 2;
+	if (len % 2 || n < 2 || n > PDU_OCTETS_MAX || hex_decode(data, raw, n) < 0)
+		return -1;
 
-	msg->msg.data = calloc(1, msg->msg.len);
-	if (!msg->msg.data)
+	pdu_msg->smsc.len = data[0];
+	if (pdu_msg->smsc.len > 11 || pdu_msg->smsc.len + 2 > n)
 		return -1;
 
-	int nlen;
-	switch (msg->udhi) {
-	case 1:
-		/* TODO THIS NEEDS TO BE TESTED */
-		nlen = decode_udh(msg, raw);
-		raw += nlen;
-		len -= nlen;
-	/* fallthrough */
+	pdu_msg->smsc.number[0] = 0;
+	if (pdu_msg->smsc.len > 0) {
+		pdu_msg->smsc.enc = data[1];
+		pdu_decode_address(pdu_msg->smsc.number, data + 2, (pdu_msg->smsc.len - 1) * 2, data[1]);
+	}
+
+	n -= 1 + pdu_msg->smsc.len;
+	pdu_msg->smstype = data[1 + pdu_msg->smsc.len] & 0x3;
+	switch (pdu_msg->smstype) {
+	case SMS_DELIVER:
+		return decode_sms_deliver(&pdu_msg->d.d, data + 1 + pdu_msg->smsc.len, n);
 	default:
-		decode_ud(&msg->msg, raw, len, msg->dcs);
+		return -1;
 	}
-	fprintf(stderr, "%s\n", msg->msg);
-	return 0;
 }
 
-int
-decode_pdu(struct pdu_msg *pdu_msg, char *raw)
+/* returns the code point at *s and moves past it, malformed UTF-8 comes
+ * out as U+FFFD */
+static uint32_t
+utf8_next(const char **s)
 {
-	size_t len = strlen(raw);
-	pdu_msg->smsc.len = pairtohex(raw);
-	raw += 2;
-	len -= 2;
+	const unsigned char *p = (const unsigned char *)*s;
+	uint32_t cp;
+	int n, i;
+
+	if (p[0] < 0x80) {
+		*s += 1;
+		return p[0];
+	} else if ((p[0] & 0xe0) == 0xc0) {
+		n = 1;
+		cp = p[0] & 0x1f;
+	} else if ((p[0] & 0xf0) == 0xe0) {
+		n = 2;
+		cp = p[0] & 0x0f;
+	} else if ((p[0] & 0xf8) == 0xf0) {
+		n = 3;
+		cp = p[0] & 0x07;
+	} else {
+		*s += 1;
+		return 0xfffd;
+	}
 
-	fprintf(stderr, "smsc.len: %d\n", pdu_msg->smsc.len);
+	for (i = 1; i <= n; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			*s += i;
+			return 0xfffd;
+		}
+		cp = cp << 6 | (p[i] & 0x3f);
+	}
 
-	char *str = calloc(1, pdu_msg->smsc.len * 2);
-	if (str == NULL)
-		return -1;
+	*s += n + 1;
+	return cp;
+}
 
-	pdu_decode_address(str, raw, pdu_msg->smsc.len * 2);
+/* returns the septet for cp with GSM_ESC set if it needs an escape, or 0
+ * if the alphabet doesn't have it */
+static unsigned int
+gsm_septet(uint32_t cp)
+{
+	const unsigned short *page = cp < 0x10000 ? gsm_pages[cp >> 8] : NULL;
 
-	if (strlen(str) > 15) {
-		fprintf(stderr, "phone number too long\n");
-		return -1;
-	}
+	return page ? page[cp & 0xff] : 0;
+}
 
-	fprintf(stderr, "str: %s\n", str);
-	strcpy(pdu_msg->smsc.number, str);
-	free(str);
+/* Packs the GSM 7-bit encoding of the UTF-8 text from str to end into
+ * data, or only counts if data is NULL, after fill zero bits that align it
+ * to a septet boundary. Characters the alphabet doesn't have become '?'.
+ * Returns the number of octets, and the number of septets in *septets. */
+static int
+pdu_encode_7bit_str(unsigned char *data, const char *str, const char *end, int fill, int *septets)
+{
+	uint32_t acc = 0;
+	int bits = fill, len = 0, count = 0;
+
+	while (str < end) {
+		unsigned int v = gsm_septet(utf8_next(&str));
+
+		if (!v)
+			v = '?';
+		if (v & GSM_ESC) {
+			acc |= GSM_ESCAPE << bits;
+			bits += 7;
+			count++;
+		}
+		acc |= (v & 0x7f) << bits;
+		bits += 7;
+		count++;
 
-	raw += pdu_msg->smsc.len * 2;
-	len -= pdu_msg->smsc.len * 2;
+		for (; bits >= 8; bits -= 8, acc >>= 8, len++) {
+			if (data)
+				data[len] = acc;
+		}
+	}
 
-	char header = pairtohex(raw);
-	pdu_msg->smstype = header & 0x3;
-	switch (pdu_msg->smstype) {
-	case SMS_DELIVER:
-		decode_sms_deliver(&pdu_msg->d.d, raw, len, header);
-		break;
+	if (bits) {
+		if (data)
+			data[len] = acc;
+		len++;
 	}
-	return 0;
+
+	*septets = count;
+	return len;
 }
 
+/* writes the UTF-8 text from str to end to data as UTF-16BE, returns the
+ * number of octets */
 static int
-pdu_encode_7bit_str(unsigned char *data, const char *str)
+pdu_encode_ucs2(unsigned char *data, const char *str, const char *end)
 {
-	unsigned char c;
 	int len = 0;
-	int ofs = 0;
 
-	while(1) {
-		c = *(str++) & 0x7f;
-		if (!c)
-			break;
+	while (str < end) {
+		uint32_t cp = utf8_next(&str);
 
-		if (data) {
-			switch(ofs) {
-			case 0:
-				data[len] = c;
-				break;
-			default:
-				data[len++] |= c << (8 - ofs);
-				data[len] = c >> ofs;
-				break;
-			}
+		if (cp >= 0x10000) {
+			cp -= 0x10000;
+			data[len++] = 0xd8 | cp >> 18;
+			data[len++] = cp >> 10;
+			cp = 0xdc00 | (cp & 0x3ff);
+		}
+		data[len++] = cp >> 8;
+		data[len++] = cp;
+	}
+
+	return len;
+}
+
+/* Takes as much of the UTF-8 text from str to end as fits in one message
+ * into seg: GSM 7-bit while every character is in the alphabet and there
+ * are at most gsmcap septets, UCS2 with at most ucs2cap octets otherwise.
+ * Returns where the rest of the text starts. */
+static const char *
+pdu_take_segment(const char *str, const char *end, int gsmcap, int ucs2cap,
+                 struct pdu_segment *seg)
+{
+	int septets = 0, octets = 0;
+	bool gsm = true;
+
+	seg->text = str;
+	while (str < end) {
+		const char *next = str;
+		int nseptets, noctets;
+		uint32_t cp;
+		unsigned int v;
+
+		/* ASCII that maps to itself needs no table lookup */
+		if ((unsigned char)*str < 0x80 && gsm_septet(*str) == (GSM_VALID | *str)) {
+			next++;
+			v = GSM_VALID;
+			cp = 0;
 		} else {
-			if (ofs != 0)
-				len++;
+			cp = utf8_next(&next);
+			v = gsm_septet(cp);
 		}
 
-		ofs = (ofs + 1) % 8;
+		nseptets = septets + (v & GSM_ESC ? 2 : 1);
+		noctets = octets + (cp >= 0x10000 ? 4 : 2);
+		if (gsm && v ? nseptets > gsmcap : noctets > ucs2cap)
+			break;
+
+		gsm = gsm && v;
+		septets = nseptets;
+		octets = noctets;
+		str = next;
+	}
+
+	seg->len = str - seg->text;
+	seg->dcs = gsm ? DCS_GSM : DCS_UCS2;
+	seg->udl = gsm ? septets : octets;
+	return str;
+}
+
+/* Splits the UTF-8 string message into the segments it is sent as, each
+ * with its own encoding. A message that doesn't fit in one SMS is cut to
+ * leave room for the concatenation header. Returns the number of
+ * segments, or -1 if there would be more than max. */
+int
+pdu_split(const char *message, struct pdu_segment *segs, int max)
+{
+	const char *end = message + strlen(message), *str;
+	int n = 0;
+
+	if (max < 1)
+		return -1;
+
+	if (pdu_take_segment(message, end, UD_SEPTETS_MAX, UD_OCTETS_MAX, &segs[0]) == end)
+		return 1;
+
+	for (str = message; str < end; n++) {
+		if (n == max)
+			return -1;
+		str = pdu_take_segment(str, end, UD_SEPTETS_MAX - UDH_CONCAT_SEPTETS,
+		                       UD_OCTETS_MAX - UDH_CONCAT_LEN, &segs[n]);
 	}
 
-	return len + 1;
+	return n;
 }
 
 static int
@@ -526,7 +568,7 @@ pdu_encode_number(unsigned char *dest, const char *str, bool smsc)
 {
 	unsigned char format;
 	bool ascii = false;
-	int len = 0;
+	int len = 0, septets;
 	int i;
 
 	if (dest)
@@ -547,8 +589,9 @@ pdu_encode_number(unsigned char *dest, const char *str, bool smsc)
 		break;
 	}
 
+	/* alphanumeric, in GSM 7-bit */
 	if (ascii)
-		format |= 0x40;
+		format = 0xd0;
 
 	if (dest)
 		dest[len] = format;
@@ -556,11 +599,13 @@ pdu_encode_number(unsigned char *dest, const char *str, bool smsc)
 	if (!ascii)
 		len += pdu_encode_semioctet(dest ? &dest[len] : NULL, str);
 	else
-		len += pdu_encode_7bit_str(dest ? &dest[len] : NULL, str);
+		len += pdu_encode_7bit_str(dest ? &dest[len] : NULL, str, str + strlen(str), 0, &septets);
 
 	if (dest) {
 		if (smsc)
 			dest[0] = len - 1;
+		else if (ascii)
+			dest[0] = (septets * 7 + 3) / 4;
 		else
 			dest[0] = strlen(str);
 	}
@@ -568,41 +613,92 @@ pdu_encode_number(unsigned char *dest, const char *str, bool smsc)
 	return len;
 }
 
+/* Encodes seg as an SMS-SUBMIT to number, with a concatenation header
+ * saying it is part of parts with reference ref if there is more than
+ * one. Only returns the length if dest is NULL. */
 int
-encode_pdu(char *dest, char *number, char *message)
+encode_pdu(char *dest, const char *number, const struct pdu_segment *seg, int ref, int part, int parts)
 {
-	int len = 0;
+	unsigned char *d = (unsigned char *)dest;
+	bool udh = parts > 1;
+	int len = 0, septets;
 
-	char *ptr = dest;
-	// may want to set bit 6 for multi-part message
-	if (dest)
-		dest[len] = 1;
+	// SMS-SUBMIT, TP-UDHI says the user data starts with a header
+	if (d)
+		d[len] = udh ? 0x41 : 0x01;
 	len++;
 
-	// message reference
-	if (dest)
-		dest[len] = 0;
+	// message reference, set by the modem
+	if (d)
+		d[len] = 0;
 	len++;
 
-	len += pdu_encode_number(dest ? &dest[len] : NULL, number, 0);
+	len += pdu_encode_number(d ? &d[len] : NULL, number, 0);
 
 	// PID
-	if (dest)
-		dest[len] = 0;
+	if (d)
+		d[len] = 0;
 	len++;
 
-	// DCS - needs to be determined from message - XXX don't assume GSM
-	if (dest)
-		dest[len] = 0;
+	if (d)
+		d[len] = seg->dcs;
 	len++;
 
-	// UDL - user data length - for now we just assume it is the number of octets in the message
-	if (dest)
-		dest[len] = strlen(message);
+	// UDL - user data length, in septets or octets, including the header
+	if (d) {
+		if (seg->dcs == DCS_GSM)
+			d[len] = seg->udl + (udh ? UDH_CONCAT_SEPTETS : 0);
+		else
+			d[len] = seg->udl + (udh ? UDH_CONCAT_LEN : 0);
+	}
 	len++;
 
-	// User Data
-	len += pdu_encode_7bit_str(dest ? &dest[len] : NULL, message);
+	if (udh) {
+		if (d) {
+			d[len] = UDH_CONCAT_LEN - 1;
+			d[len + 1] = 0x00; /* concatenation, 8-bit reference */
+			d[len + 2] = 3;
+			d[len + 3] = ref;
+			d[len + 4] = parts;
+			d[len + 5] = part;
+		}
+		len += UDH_CONCAT_LEN;
+	}
 
-	return len;
+	if (seg->dcs == DCS_UCS2)
+		return len + (d ? pdu_encode_ucs2(&d[len], seg->text, seg->text + seg->len) : seg->udl);
+
+	/* the text starts at the first septet boundary after the header */
+	return len + pdu_encode_7bit_str(d ? &d[len] : NULL, seg->text, seg->text + seg->len,
+	                                 udh ? UDH_CONCAT_SEPTETS * 7 - UDH_CONCAT_LEN * 8 : 0, &septets);
+}
+
+/* Encodes seg as an SMS-DELIVER from sender with a fixed timestamp, the
+ * way a modem shows it after +CMT: behind an empty SMSC address. It is
+ * the SMS-SUBMIT encode_pdu() makes with the header of a DELIVER, for
+ * simulating a modem. Only returns the length if dest is NULL. */
+int
+encode_deliver(char *dest, const char *sender, const struct pdu_segment *seg, int ref, int part, int parts)
+{
+	/* 2022-06-17 14:00:00 UTC, in swapped BCD */
+	static const unsigned char scts[7] = { 0x22, 0x60, 0x71, 0x41, 0x00, 0x00, 0x00 };
+	unsigned char sub[PDU_OCTETS_MAX], *d = (unsigned char *)dest;
+	int len, addr, n = 0;
+
+	/* the SMSC octet and the timestamp, but no message reference */
+	if (!d)
+		return encode_pdu(NULL, sender, seg, ref, part, parts) + 7;
+
+	len = encode_pdu((char *)sub, sender, seg, ref, part, parts);
+	addr = 2 + (sub[2] + 1) / 2;
+
+	d[n++] = 0;
+	d[n++] = 0x04 | (sub[0] & 0x40); /* SMS-DELIVER, keeping TP-UDHI */
+	memcpy(d + n, sub + 2, addr + 2); /* address, PID and DCS */
+	n += addr + 2;
+	memcpy(d + n, scts, sizeof(scts));
+	n += sizeof(scts);
+	memcpy(d + n, sub + 4 + addr, len - 4 - addr); /* UDL and UD */
+
+	return n + len - 4 - addr;
 }
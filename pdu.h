@@ -8,15 +8,27 @@ enum smstype {
 	SMS_SUBMIT = 1,
 };
 
+/* 12 octets of SMSC address and a TPDU of at most 164 octets */
+#define PDU_OCTETS_MAX 176
+/* 140 octets of user data */
+#define UD_OCTETS_MAX 140
+#define UD_SEPTETS_MAX 160
+/* A septet decodes to at most 2 bytes of UTF-8, the 3 byte euro sign
+ * takes two septets. A UCS2 code unit takes at most 3 bytes. */
+#define MSG_DATA_MAX (2 * UD_SEPTETS_MAX + 1)
+/* An alphanumeric address is up to 11 septets, a numeric one up to 20
+ * digits and a '+'. */
+#define NUMBER_MAX (2 * 11 + 1)
+
 struct phonenumber {
 	uint8_t len;
 	char enc;
-	char number[15];
+	char number[NUMBER_MAX];
 };
 
-/* data is utf-8 encoded */
+/* data is utf-8 encoded, len is the user data length from the PDU */
 struct message {
-	char *data;
+	char data[MSG_DATA_MAX];
 	uint8_t len;
 };
 
@@ -47,6 +59,20 @@ struct sms_deliver_msg {
 	struct message msg;
 };
 
+/* A piece of message text that is sent as one SMS, udl is its length in
+ * septets or octets without the header. A concatenation header takes 6
+ * octets, 7 septets with the fill bits. */
+struct pdu_segment {
+	const char *text;
+	size_t len;
+	enum dcs dcs;
+	int udl;
+};
+
+#define PDU_SEGMENTS_MAX 255
+#define UDH_CONCAT_LEN 6
+#define UDH_CONCAT_SEPTETS 7
+
 struct pdu_msg {
 	struct phonenumber smsc;
 	enum smstype smstype;
@@ -55,6 +81,9 @@ struct pdu_msg {
 	} d;
 };
 
-int encode_pdu(char *dest, char *number, char *message);
-int decode_pdu(struct pdu_msg *pdu_msg, char *raw);
-char *htoa(char *str, char val);
+int pdu_split(const char *message, struct pdu_segment *segs, int max);
+int encode_pdu(char *dest, const char *number, const struct pdu_segment *seg, int ref, int part, int parts);
+int encode_deliver(char *dest, const char *sender, const struct pdu_segment *seg, int ref, int part, int parts);
+int pdu_decode_7bit(char *dest, const unsigned char *data, int count, int skip);
+int pdu_decode_ucs2(char *dest, const unsigned char *data, int len);
+int decode_pdu(struct pdu_msg *pdu_msg, const char *raw, size_t len);
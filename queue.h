@@ -1,30 +1,109 @@
 #define QUEUE_SIZE 50
+#define AGE_LIMIT 4 /* dequeues a waiting class can be passed over for */
 
-struct {
+/* one FIFO per priority class, QUEUE_SIZE limits the total so none of
+ * them can overflow */
+struct cmdring {
     struct command cmds[QUEUE_SIZE];
     int first;
     int next; /* where to place the next command */
     int count;
+    int skipped; /* times a higher class was served while this one waited */
+};
+
+struct {
+    struct cmdring q[PRIO_LAST];
+    int count;
+    struct command *pending[CMD_LAST]; /* queued command to merge into */
 } cmdq;
 
-int command_enqueue(struct command cmd) {
+/* whether a command with op would be merged into a queued duplicate */
+bool command_mergeable(enum ops op, const struct command_args *args) {
+    const struct command *dup = cmdq.pending[op];
+
+    return args->coalesce && dup && dup->nwaiters < MAX_WAITERS;
+}
+
+int command_enqueue(struct command cmd, const struct command_args *args) {
+    struct cmdring *q = &cmdq.q[args->prio];
+    struct command *dup = cmdq.pending[cmd.op];
+
+    /* the queued one will do, the client just waits for its result */
+    if (command_mergeable(cmd.op, args)) {
+        dup->waiters[dup->nwaiters++] = cmd.index;
+        return cmdq.count;
+    }
+
     assert(cmdq.count <= QUEUE_SIZE);
     if (cmdq.count == QUEUE_SIZE)
         return -1;
 
-    cmdq.cmds[cmdq.next] = cmd;
-    cmdq.next = (cmdq.next + 1) % QUEUE_SIZE;
+    if (args->coalesce)
+        cmdq.pending[cmd.op] = &q->cmds[q->next];
+
+    q->cmds[q->next] = cmd;
+    q->next = (q->next + 1) % QUEUE_SIZE;
+    q->count++;
     return ++cmdq.count;
 }
 
+/* stops c from reporting its result to the client in slot index */
+void command_forget(struct command *c, int index) {
+    if (c->index == index)
+        c->index = -1;
+
+    for (int i = 0; i < c->nwaiters; i++) {
+        if (c->waiters[i] == index)
+            c->waiters[i--] = c->waiters[--c->nwaiters];
+    }
+}
+
+/* called when a client goes away, its slot may be handed to the next
+ * connection while its commands are still queued */
+void command_forget_client(int index) {
+    for (int p = 0; p < PRIO_LAST; p++) {
+        struct cmdring *q = &cmdq.q[p];
+
+        for (int n = 0; n < q->count; n++)
+            command_forget(&q->cmds[(q->first + n) % QUEUE_SIZE], index);
+    }
+}
+
+/* takes from the highest priority class that has a command, unless a lower
+ * one has been passed over AGE_LIMIT times, so nothing starves */
 struct command command_dequeue() {
     struct command cmd;
+    struct cmdring *q;
+    int pick = -1;
+
     if (cmdq.count == 0)
         return (struct command){ .op = CMD_NONE };
 
-    cmd = cmdq.cmds[cmdq.first];
-    cmdq.cmds[cmdq.first].op = CMD_NONE;
-    cmdq.first = (cmdq.first + 1) % QUEUE_SIZE;
+    for (int p = 0; p < PRIO_LAST; p++) {
+        if (cmdq.q[p].count == 0)
+            continue;
+
+        if (pick == -1) {
+            pick = p;
+        } else if (cmdq.q[p].skipped >= AGE_LIMIT) {
+            pick = p;
+            break;
+        }
+    }
+
+    for (int p = 0; p < PRIO_LAST; p++) {
+        if (p != pick && cmdq.q[p].count)
+            cmdq.q[p].skipped++;
+    }
+
+    q = &cmdq.q[pick];
+    q->skipped = 0;
+    cmd = q->cmds[q->first];
+    if (cmdq.pending[cmd.op] == &q->cmds[q->first])
+        cmdq.pending[cmd.op] = NULL;
+    q->cmds[q->first].op = CMD_NONE;
+    q->first = (q->first + 1) % QUEUE_SIZE;
+    q->count--;
     cmdq.count--;
     return cmd;
 }
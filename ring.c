@@ -0,0 +1,99 @@
+/* See LICENSE file for copyright and license details. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+int
+ring_init(struct ring *r, size_t size)
+{
+	size_t sz = sysconf(_SC_PAGESIZE);
+	char *base;
+	int fd;
+
+	while (sz < size)
+		sz <<= 1;
+
+	fd = memfd_create("atd-ring", MFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (ftruncate(fd, sz) == -1)
+		goto err;
+
+	/* reserve both halves first so the second mapping can't collide */
+	base = mmap(NULL, 2 * sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		goto err;
+
+	if (mmap(base, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(base + sz, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, 2 * sz);
+		goto err;
+	}
+
+	close(fd);
+	r->buf = base;
+	r->size = sz;
+	r->head = r->tail = 0;
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
+
+void
+ring_free(struct ring *r)
+{
+	if (r->buf)
+		munmap(r->buf, 2 * r->size);
+	r->buf = NULL;
+}
+
+/* copies all of data into the ring, or nothing if it doesn't fit */
+size_t
+ring_put(struct ring *r, const void *data, size_t len)
+{
+	if (len > ring_space(r))
+		return 0;
+
+	memcpy(ring_wptr(r), data, len);
+	ring_commit(r, len);
+	return len;
+}
+
+ssize_t
+ring_read(struct ring *r, int fd)
+{
+	ssize_t ret;
+
+	if (ring_space(r) == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	ret = read(fd, ring_wptr(r), ring_space(r));
+	if (ret > 0)
+		ring_commit(r, ret);
+
+	return ret;
+}
+
+ssize_t
+ring_write(struct ring *r, int fd)
+{
+	ssize_t ret;
+
+	if (ring_len(r) == 0)
+		return 0;
+
+	ret = write(fd, ring_data(r), ring_len(r));
+	if (ret > 0)
+		ring_consume(r, ret);
+
+	return ret;
+}
@@ -0,0 +1,69 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* A byte ring whose storage is mapped twice back to back, so the readable
+ * and writable regions are always contiguous in memory and nothing ever
+ * has to be moved or copied across the wrap point. head and tail are free
+ * running counters, size is a power of two. */
+struct ring {
+	char *buf;
+	size_t size;
+	size_t head; /* consumed up to here */
+	size_t tail; /* filled up to here */
+};
+
+int ring_init(struct ring *r, size_t size);
+void ring_free(struct ring *r);
+size_t ring_put(struct ring *r, const void *data, size_t len);
+ssize_t ring_read(struct ring *r, int fd);
+ssize_t ring_write(struct ring *r, int fd);
+
+static inline size_t
+ring_len(const struct ring *r)
+{
+	return r->tail - r->head;
+}
+
+static inline size_t
+ring_space(const struct ring *r)
+{
+	return r->size - ring_len(r);
+}
+
+/* start of the ring_len() readable bytes */
+static inline char *
+ring_data(const struct ring *r)
+{
+	return r->buf + (r->head & (r->size - 1));
+}
+
+/* start of the ring_space() writable bytes */
+static inline char *
+ring_wptr(const struct ring *r)
+{
+	return r->buf + (r->tail & (r->size - 1));
+}
+
+static inline void
+ring_consume(struct ring *r, size_t len)
+{
+	r->head += len;
+}
+
+static inline void
+ring_commit(struct ring *r, size_t len)
+{
+	r->tail += len;
+}
+
+static inline void
+ring_reset(struct ring *r)
+{
+	r->head = r->tail = 0;
+}
+
+#endif /* RING_H */
@@ -0,0 +1,114 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+static FILE *tracef;
+static uint64_t last; /* time of the previous record */
+
+static void
+put_varint(FILE *f, uint64_t v)
+{
+	while (v >= 0x80) {
+		putc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	putc(v, f);
+}
+
+static int
+get_varint(FILE *f, uint64_t *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		if ((c = getc(f)) == EOF || shift > 63)
+			return -1;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+/* starts recording to path, which is truncated */
+int
+trace_open(const char *path)
+{
+	if (!(tracef = fopen(path, "w")))
+		return -1;
+
+	last = 0;
+	if (fputs(TRACE_MAGIC, tracef) == EOF) {
+		fclose(tracef);
+		tracef = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Records len bytes that went in direction dir at now, in monotonic us.
+ * Does nothing unless trace_open() succeeded. Writes are buffered, the
+ * trace is complete once trace_close() or exit() flushed it. */
+void
+trace_record(enum trace_dir dir, const char *buf, size_t len, uint64_t now)
+{
+	if (!tracef || len == 0)
+		return;
+
+	putc(dir, tracef);
+	put_varint(tracef, last ? now - last : 0);
+	put_varint(tracef, len);
+	fwrite(buf, 1, len, tracef);
+	last = now;
+}
+
+void
+trace_close(void)
+{
+	if (tracef)
+		fclose(tracef);
+	tracef = NULL;
+}
+
+/* reads the magic, returns -1 if f isn't a trace */
+int
+trace_check(FILE *f)
+{
+	char magic[sizeof(TRACE_MAGIC) - 1];
+
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	    memcmp(magic, TRACE_MAGIC, sizeof(magic)))
+		return -1;
+
+	return 0;
+}
+
+/* Reads the next record into r, with its bytes in buf, which has room for
+ * TRACE_REC_MAX. Returns 1, 0 at the end of the trace or -1 if it is
+ * truncated or malformed. */
+int
+trace_next(FILE *f, struct trace_rec *r, char *buf)
+{
+	uint64_t len;
+	int c;
+
+	if ((c = getc(f)) == EOF)
+		return 0;
+
+	if ((c != TRACE_READ && c != TRACE_WRITE) || get_varint(f, &r->delta) == -1 ||
+	    get_varint(f, &len) == -1 || len > TRACE_REC_MAX)
+		return -1;
+
+	if (fread(buf, 1, len, f) != len)
+		return -1;
+
+	r->dir = c;
+	r->len = len;
+	r->data = buf;
+	return 1;
+}
@@ -0,0 +1,30 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef TRACE_H
+#define TRACE_H
+
+/* A trace of the traffic with the modem: TRACE_MAGIC, then one record per
+ * read or write. A record is a direction byte, the microseconds since the
+ * previous record and the length as LEB128 varints, and the bytes. */
+#define TRACE_MAGIC "ATDTRC1\n"
+#define TRACE_REC_MAX 65536
+
+enum trace_dir {
+	TRACE_READ = '<', /* modem to atd */
+	TRACE_WRITE = '>', /* atd to modem */
+};
+
+struct trace_rec {
+	enum trace_dir dir;
+	uint64_t delta; /* us since the previous record */
+	size_t len;
+	char *data;
+};
+
+int trace_open(const char *path);
+void trace_record(enum trace_dir dir, const char *buf, size_t len, uint64_t now);
+void trace_close(void);
+
+int trace_check(FILE *f);
+int trace_next(FILE *f, struct trace_rec *r, char *buf);
+
+#endif /* TRACE_H */